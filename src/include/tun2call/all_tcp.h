@@ -7,8 +7,10 @@ extern "C" {
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#include <sys/uio.h>
 
 struct all_tcp_handler;
+struct all_tcp_source;
 
 enum all_tcp_states {
   ES_NONE = 0,
@@ -25,6 +27,11 @@ struct all_tcp_pcb {
   struct pbuf *recving;
   struct pbuf *sending;
   struct all_tcp_handler *handler;
+  struct all_tcp_source *source;
+  u32_t recved; /* consumed bytes not yet reported by tcp_recved */
+  u32_t recv_charged;
+  u32_t send_charged;
+  u32_t id; /* 4-tuple hash naming the flow in traces */
 };
 
 typedef void (*all_tcp_select_fn)(struct all_tcp_handler *handler);
@@ -41,6 +48,28 @@ typedef void (*all_tcp_error_fn)(struct all_tcp_handler *handler, struct all_tcp
 
 typedef void (*all_tcp_accept_fn)(struct all_tcp_handler *handler, struct all_tcp_pcb *pcb);
 
+enum all_tcp_syn_states {
+  SS_NONE = 0,
+  SS_PENDING,
+  SS_ACCEPTED
+};
+
+/* a connection attempt held at its SYN until the app answers it */
+struct all_tcp_syn {
+  void *user; /* handed on to all_tcp_pcb.user when the handshake completes */
+  ip_addr_t local_ip;
+  ip_addr_t remote_ip;
+  u16_t local_port;
+  u16_t remote_port;
+  u8_t state;
+  u8_t netif_idx;
+  u32_t seqno;
+  u32_t time;
+  struct pbuf *p;
+};
+
+typedef void (*all_tcp_syn_fn)(struct all_tcp_handler *handler, struct all_tcp_syn *syn);
+
 struct all_tcp_handler {
   void *user;
   struct tcp_pcb *listener;
@@ -51,6 +80,32 @@ struct all_tcp_handler {
   all_tcp_poll_fn poll;
   all_tcp_close_fn close;
   all_tcp_error_fn error;
+  /* called at SYN time when set and filter is all_tcp_syn_filter, the app must answer
+   * every syn with all_tcp_syn_accept or all_tcp_syn_reject */
+  all_tcp_syn_fn syn;
+  /* called when a syn handed to syn ends without a connection, left unanswered too long, over
+   * the limits at accept time or the handshake never completing, so the app can release
+   * syn->user, the syn must not be answered after this, all_tcp_init fails with ERR_ARG when
+   * syn is set without it */
+  all_tcp_syn_fn syn_abandon;
+  u32_t syn_max;
+  struct all_tcp_syn *syns;
+  /* accept limits, zero means unlimited */
+  u32_t max_conns;
+  u32_t max_conns_per_ip;
+  u32_t accept_rate;  /* accepted connections per second */
+  u32_t accept_burst; /* bucket size, defaults to accept_rate */
+  /* accept state, conns and sources live on through all_tcp_free and a later all_tcp_init
+   * while accepted pcbs remain, zero the handler before the first all_tcp_init */
+  u32_t conns;
+  u32_t accept_tokens;
+  u32_t accept_last;
+  struct all_tcp_source *sources;
+  /* reject counters */
+  u32_t rejected_conns;
+  u32_t rejected_per_ip;
+  u32_t rejected_rate;
+  u32_t rejected_mem;
 };
 
 err_t all_tcp_init(struct all_tcp_handler *handler);
@@ -59,6 +114,19 @@ void all_tcp_close(struct all_tcp_pcb *pcb);
 void all_tcp_send(struct all_tcp_pcb *pcb);
 void all_tcp_send_buf(struct all_tcp_pcb *pcb, struct pbuf *buf);
 void all_tcp_select(struct all_tcp_handler *handler);
+/* netif_handler filter holding new connections at their SYN, filter_arg is the all_tcp_handler */
+int all_tcp_syn_filter(void *arg, struct netif *netif, struct pbuf *p);
+/* let the handshake of syn go on, the app gets accept once it completes, answering a syn
+ * that is no longer pending does nothing */
+void all_tcp_syn_accept(struct all_tcp_handler *handler, struct all_tcp_syn *syn);
+/* refuse syn with a RST */
+void all_tcp_syn_reject(struct all_tcp_handler *handler, struct all_tcp_syn *syn);
+/* put the packets of pcb into egress class cls, see enum netif_class */
+void all_tcp_set_class(struct all_tcp_pcb *pcb, int cls);
+/* fill up to iovcnt iovecs over the queued receive data without copying, returns the count used */
+int all_tcp_peek(struct all_tcp_pcb *pcb, struct iovec *iov, int iovcnt);
+/* drop n bytes from the head of the queued receive data and reopen the window */
+void all_tcp_consume(struct all_tcp_pcb *pcb, u32_t n);
 
 #ifdef __cplusplus
 }
@@ -9,23 +9,75 @@ extern "C" {
 #include "lwip/pbuf.h"
 #include "lwip/udp.h"
 
+#ifndef ALL_UDP_BATCH_MAX
+#define ALL_UDP_BATCH_MAX 64
+#endif
+#ifndef ALL_UDP_ROUTE_SIZE
+#define ALL_UDP_ROUTE_SIZE 16
+#endif
+#ifndef ALL_UDP_FLOW_SIZE
+#define ALL_UDP_FLOW_SIZE 256
+#endif
+
 struct all_udp_handler;
+struct dns_cache;
+
+struct all_udp_datagram {
+  ip_addr_t local_addr;
+  ip_addr_t remote_addr;
+  u16_t local_port;
+  u16_t remote_port;
+  struct pbuf *p;
+};
+
+struct all_udp_route {
+  ip_addr_t src;
+  ip_addr_t dst;
+  u8_t netif_idx;
+};
 
+/* the app owns p and hands it back with all_udp_release before sending or freeing it */
 typedef void (*all_udp_handler_recv_fn)(struct all_udp_handler *handler, struct udp_pcb *pcb, const ip_addr_t *remote_addr,
                                         u16_t remote_port, struct pbuf *p);
 typedef int (*all_udp_handler_poll_fn)(struct all_udp_handler *handler, struct udp_pcb *pcb);
+/* datagrams of one flow are adjacent and in arrival order, the app owns every pbuf and hands
+ * each back with all_udp_release */
+typedef void (*all_udp_handler_recv_batch_fn)(struct all_udp_handler *handler, struct all_udp_datagram *dgs, int n);
 struct all_udp_handler {
   void *user;
   struct udp_pcb *listener;
   all_udp_handler_recv_fn recv;
   all_udp_handler_poll_fn poll;
+  /* when set, datagrams are collected until all_udp_poll and delivered here instead of recv,
+   * netif_handler.read_max decides how many one netif_default_poll pass can collect */
+  all_udp_handler_recv_batch_fn recv_batch;
+  int batch_max;
+  int batch_len;
+  struct all_udp_datagram *batch;
+  struct all_udp_route routes[ALL_UDP_ROUTE_SIZE];
+  /* ids of flows delivered to the app, at MEMGOV_HARD only other flows are rejected */
+  u32_t flows[ALL_UDP_FLOW_SIZE];
+  /* answer repeated queries to port 53 in stack, zero disables */
+  int dns_cache_size;
+  struct dns_cache *dns_cache;
+  u32_t dns_hits;
+  u32_t dns_misses;
+  u32_t rejected_mem;
 };
 
 err_t all_udp_init(struct all_udp_handler *handler);
 void all_udp_free(struct all_udp_handler *handler);
 int all_udp_poll(struct all_udp_handler *handler);
+/* stop charging a received pbuf to MEMGOV_UDP, call it once per datagram while p is still as
+ * delivered, before sending it on or freeing it */
+void all_udp_release(struct all_udp_handler *handler, struct pbuf *p);
 err_t all_udp_sendto(struct all_udp_handler *handler, const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr,
                      u16_t remote_port, struct pbuf *p);
+/* send n datagrams, grouping adjacent ones of the same flow, returns how many were sent */
+int all_udp_sendto_batch(struct all_udp_handler *handler, struct all_udp_datagram *dgs, int n);
+/* all_udp_sendto in egress class cls, see enum netif_class */
+err_t all_udp_sendto_class(struct all_udp_handler *handler, int cls, const ip_addr_t *local_addr, u16_t local_port,
+                           const ip_addr_t *remote_addr, u16_t remote_port, struct pbuf *p);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,18 @@
+#ifndef CHKSUM_H
+#define CHKSUM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* drop-in for LWIP_CHKSUM, returns the folded but not complemented one's
+ * complement sum of len bytes, dataptr may have any alignment */
+uint16_t chksum_fast(const void *dataptr, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
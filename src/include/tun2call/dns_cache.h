@@ -0,0 +1,25 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lwip/ip.h"
+#include "lwip/pbuf.h"
+
+struct dns_cache;
+
+/* size is the number of direct mapped slots, a colliding answer replaces the old one */
+struct dns_cache *dns_cache_new(int size);
+void dns_cache_free(struct dns_cache *cache);
+/* answer query q sent to server from the cache, NULL on a miss */
+struct pbuf *dns_cache_lookup(struct dns_cache *cache, const ip_addr_t *server, struct pbuf *q);
+/* remember response r from server until its smallest ttl runs out */
+void dns_cache_store(struct dns_cache *cache, const ip_addr_t *server, struct pbuf *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef MEMGOV_H
+#define MEMGOV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lwip/opt.h"
+
+enum memgov_subsys {
+  /* malloc'd by tun2call */
+  MEMGOV_TCP_PCB = 0,
+  MEMGOV_DNS,
+  /* pbuf bytes held by tun2call, also part of MEMGOV_LWIP when lwIP keeps stats */
+  MEMGOV_TCP_RECV,
+  MEMGOV_TCP_SEND,
+  MEMGOV_UDP,
+  MEMGOV_SCHED,
+  /* lwIP pools and heap, sampled from lwip_stats */
+  MEMGOV_LWIP,
+  MEMGOV_MAX
+};
+
+enum memgov_levels {
+  MEMGOV_OK = 0,
+  MEMGOV_SOFT, /* window updates are held back */
+  MEMGOV_HARD  /* tcp data is refused, tun reads are throttled and new flows rejected */
+};
+
+/* budget in bytes, watermarks in percent of it, a zero budget disables the governor */
+void memgov_set_budget(u32_t budget, u8_t soft_pct, u8_t hard_pct);
+void memgov_charge(int subsys, u32_t n);
+void memgov_uncharge(int subsys, u32_t n);
+/* bytes held by subsys, MEMGOV_MAX for the total the watermarks apply to */
+u32_t memgov_used(int subsys);
+int memgov_level(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,25 +8,87 @@ extern "C" {
 #include "lwip/ip.h"
 #include "lwip/pbuf.h"
 
+/* netif_handler trust_chksum flags */
+#define NETIF_TRUST_CHKSUM_RX 0x01 /* skip verifying packets read from the tun */
+#define NETIF_TRUST_CHKSUM_TX 0x02 /* leave tcp checksums to the kernel, see netif_handler_vnet_hdr */
+
+/* length of the virtio_net_hdr prefix on a tun opened with IFF_VNET_HDR, it
+ * comes before every packet read as well as written, read() must skip it */
+#define NETIF_VNET_HDR_LEN 10
+
+#ifndef NETIF_HANDLER_IP6_MAX
+#define NETIF_HANDLER_IP6_MAX (LWIP_IPV6_NUM_ADDRESSES - 1) /* slot 0 is the link-local address */
+#endif
+
+/* egress priority classes, served in this order */
+enum netif_class {
+  NETIF_CLASS_INTERACTIVE = 0,
+  NETIF_CLASS_NORMAL,
+  NETIF_CLASS_BULK,
+  NETIF_CLASS_MAX
+};
+
+struct netif_class_stats {
+  u32_t packets;
+  u32_t drops;
+  u32_t queued;
+  u32_t delay_sum; /* ms spent queued by all written packets */
+  u32_t delay_max;
+};
+
 struct netif_handler;
 typedef void (*netif_handler_init_fn)(struct netif_handler *handler, struct netif *netif);
 typedef struct pbuf *(*netif_handler_read_fn)(struct netif_handler *handler);
 typedef ssize_t (*netif_handler_write_fn)(struct netif_handler *handler, struct pbuf *p);
+/* sees every packet read before lwIP does, returns nonzero when it took over p */
+typedef int (*netif_handler_filter_fn)(void *arg, struct netif *netif, struct pbuf *p);
 
 struct netif_handler {
   void *user;
   ip4_addr_t ipaddr;
   ip4_addr_t netmask;
   ip4_addr_t gw;
+  u16_t mtu; /* zero is 1500 */
   netif_handler_init_fn init;
   netif_handler_read_fn read;
   netif_handler_write_fn write;
+  netif_handler_filter_fn filter;
+  void *filter_arg;
+  /* packets netif_default_poll() reads per pass until read returns NULL, zero is one,
+   * above one read must not block once the tun is drained */
+  int read_max;
   int enable_ipv6;
+  int trust_chksum;
+  /* queue output by class and flow instead of writing it at once, netif_default_poll() and
+   * netif_default_flush() write it out */
+  int enable_sched;
+  u32_t sched_rate; /* bytes per second, zero is unlimited */
+#if LWIP_IPV6
+  /* global addresses, lwIP takes each as an on-link /64 and has no other prefix lengths */
+  ip6_addr_t ip6addr[NETIF_HANDLER_IP6_MAX];
+  int ip6count;
+#endif
 };
 void netif_handler_set(struct netif_handler *handler, u32_t ipaddr, u32_t netmask, u32_t gw);
+#if LWIP_IPV6
+err_t netif_handler_add_ip6(struct netif_handler *handler, const ip6_addr_t *ip6addr);
+#endif
+/* fill the virtio_net_hdr write() puts before p, with NETIF_TRUST_CHKSUM_TX it has the kernel
+ * finish the tcp checksum (VIRTIO_NET_HDR_F_NEEDS_CSUM) and seeds p with the pseudo header sum,
+ * udp is always checksummed by lwIP */
+size_t netif_handler_vnet_hdr(struct netif_handler *handler, struct pbuf *p, void *hdr);
 void netif_default_init(struct netif_handler *handler);
 void netif_default_poll();
+/* write out what the scheduler lets through now, call it after sending outside
+ * netif_default_poll() and, while sched_rate holds packets back and read blocks,
+ * from a timer, returns the packets still queued */
+u32_t netif_default_flush();
 void netif_default_free();
+/* apply handler to the running netif, connections survive when their addresses do */
+void netif_default_update(struct netif_handler *handler);
+void netif_default_class_stats(int cls, struct netif_class_stats *stats);
+/* ip tos byte that puts packets of a pcb into class cls */
+u8_t netif_class_tos(int cls);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,59 @@
+#ifndef NETIF_SCHED_H
+#define NETIF_SCHED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "netif.h"
+
+#ifndef NETIF_SCHED_FLOWS
+#define NETIF_SCHED_FLOWS 64 /* flow queues per class */
+#endif
+#ifndef NETIF_SCHED_LIMIT
+#define NETIF_SCHED_LIMIT 1024 /* packets queued over all classes */
+#endif
+#define NETIF_SCHED_QUANTUM 1514
+
+struct netif_sched_pkt {
+  struct netif_sched_pkt *next;
+  struct pbuf *p;
+  u32_t enqueued;
+};
+
+struct netif_sched_flow {
+  struct netif_sched_pkt *head;
+  struct netif_sched_pkt *tail;
+  struct netif_sched_flow *next;
+  s32_t deficit;
+  u8_t active;
+};
+
+struct netif_sched_class {
+  struct netif_sched_flow flows[NETIF_SCHED_FLOWS];
+  struct netif_sched_flow *active_head;
+  struct netif_sched_flow *active_tail;
+  struct netif_class_stats stats;
+};
+
+/* strict priority between classes, deficit round robin between the flows of a class */
+struct netif_sched {
+  struct netif_sched_class classes[NETIF_CLASS_MAX];
+  struct netif_sched_pkt *free_pkts;
+  u32_t queued;
+  s32_t tokens;
+  u32_t last;
+};
+
+void netif_sched_init(struct netif_sched *sched);
+void netif_sched_clear(struct netif_sched *sched);
+/* takes a reference on p, ERR_MEM when the queue is full */
+err_t netif_sched_enqueue(struct netif_sched *sched, struct pbuf *p);
+/* next packet to write, NULL when empty or over rate (bytes per second, zero unlimited) */
+struct pbuf *netif_sched_dequeue(struct netif_sched *sched, u32_t rate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x54435432
+#define TRACE_VERSION 1
+
+enum trace_events {
+  TRACE_NONE = 0,
+  TRACE_TCP_SYN,       /* arg: destination port */
+  TRACE_TCP_ACCEPT,    /* arg: destination port */
+  TRACE_TCP_RECV,      /* arg: bytes queued for the app */
+  TRACE_TCP_CONSUME,   /* arg: bytes the app took off the queue */
+  TRACE_TCP_SEND_BUF,  /* arg: bytes handed over by the app */
+  TRACE_TCP_WRITE,     /* arg: bytes accepted by tcp_write */
+  TRACE_TCP_WRITE_MEM, /* arg: bytes deferred on ERR_MEM */
+  TRACE_TCP_CLOSE,
+  TRACE_UDP_RECV,      /* arg: datagram length */
+  TRACE_UDP_SEND,      /* arg: datagram length */
+  TRACE_UDP_DNS_HIT,   /* arg: answer length */
+  TRACE_NETIF_INPUT,   /* arg: packet length */
+  TRACE_NETIF_OUTPUT,  /* arg: packet length */
+  TRACE_NETIF_THROTTLE,
+  TRACE_MAX
+};
+
+struct trace_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+/* fixed size records in host byte order, the file is read on the same machine */
+struct trace_record {
+  uint64_t ns; /* CLOCK_MONOTONIC */
+  uint32_t flow;
+  uint32_t arg;
+  uint16_t event;
+  uint16_t reserved;
+  uint32_t pad;
+};
+
+/* flow field of the records, one formula for tcp and udp so both sides of a proxied flow
+ * line up, takes ip_addr_t pointers and needs addr_hash.h where it is used */
+#define TRACE_FLOW_ID(local_ip, local_port, remote_ip, remote_port) \
+  (addr_hash(local_ip) ^ (addr_hash(remote_ip) >> 1) ^          \
+   (((uint32_t)(local_port) << 16) | (uint32_t)(remote_port)))
+
+/* start recording to path, fails when built without TUN2CALL_TRACE */
+int trace_open(const char *path);
+void trace_close(void);
+
+#if TUN2CALL_TRACE
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT(event, flow, arg) DTRACE_PROBE2(tun2call, event, flow, arg)
+#endif
+#endif
+#ifndef TRACE_USDT
+#define TRACE_USDT(event, flow, arg)
+#endif
+extern int trace_enabled_;
+void trace_emit(uint16_t event, uint32_t flow, uint32_t arg);
+#define TRACE(event, flow, arg)                       \
+  do {                                                \
+    TRACE_USDT(event, flow, arg);                     \
+    if (trace_enabled_) {                             \
+      trace_emit(TRACE_##event, (flow), (arg));       \
+    }                                                 \
+  } while (0)
+#else
+#define TRACE(event, flow, arg) \
+  do {                          \
+  } while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
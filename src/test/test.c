@@ -68,6 +68,7 @@ void all_udp_handler_recv(struct all_udp_handler* handler,
                           const ip_addr_t* remote_addr,
                           u16_t remote_port,
                           struct pbuf* p) {
+  all_udp_release(handler, p);
   all_udp_sendto(handler, &pcb->local_ip, pcb->local_port, remote_addr,
                  remote_port, p);
   pbuf_free(p);
@@ -0,0 +1,181 @@
+/* Fuzz-equivalence test and microbenchmark for the LWIP_CHKSUM replacement.
+ *
+ *   tun2call_chksum [fuzz_rounds [bench_rounds]]
+ *
+ * every sum routine the cpu supports is checked against lwIP's
+ * lwip_standard_chksum over random lengths, alignments and contents, then
+ * timed against it, exits non-zero on the first mismatch */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* built in so the per-cpu routines can be called directly, not only the selected one */
+#include "../tun2call/chksum.c"
+
+#define FOLD_U32T(u) (((u) >> 16) + ((u)&0x0000ffffUL))
+#define SWAP_BYTES_IN_WORD(w) ((((w)&0xff) << 8) | (((w)&0xff00) >> 8))
+
+/* lwip_standard_chksum, LWIP_CHKSUM_ALGORITHM 2 */
+static uint16_t lwip_standard_chksum(const void *dataptr, int len) {
+  const uint8_t *pb = (const uint8_t *)dataptr;
+  const uint16_t *ps;
+  uint16_t t = 0;
+  uint32_t sum = 0;
+  int odd = ((uintptr_t)pb & 1);
+  if (odd && len > 0) {
+    ((uint8_t *)&t)[1] = *pb++;
+    len--;
+  }
+  ps = (const uint16_t *)(const void *)pb;
+  while (len > 1) {
+    sum += *ps++;
+    len -= 2;
+  }
+  if (len > 0) {
+    ((uint8_t *)&t)[0] = *(const uint8_t *)ps;
+  }
+  sum += t;
+  sum = FOLD_U32T(sum);
+  sum = FOLD_U32T(sum);
+  if (odd) {
+    sum = SWAP_BYTES_IN_WORD(sum);
+  }
+  return (uint16_t)sum;
+}
+
+/* lwip_standard_chksum sums into 32 bits, so it takes big buffers in 64k pieces,
+ * even sized to keep every piece at the parity of dataptr */
+static uint16_t lwip_chksum_big(const uint8_t *p, int len) {
+  uint32_t sum = 0;
+  while (len > 0) {
+    int n = len < 0x10000 ? len : 0x10000;
+    sum += lwip_standard_chksum(p, n);
+    p += n;
+    len -= n;
+  }
+  sum = FOLD_U32T(sum);
+  sum = FOLD_U32T(sum);
+  return (uint16_t)sum;
+}
+
+/* past the point where every vector routine flushes its lanes at least once */
+#define FUZZ_MAX (CHKSUM_BLOCKS * 32 + 4096)
+
+struct variant {
+  const char *name;
+  chksum_sum_fn sum;
+};
+
+static struct variant variants_[4];
+static int nvariants_ = 0;
+
+static void variants_init(void) {
+  variants_[nvariants_].name = "scalar";
+  variants_[nvariants_++].sum = chksum_sum_scalar;
+#if CHKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    variants_[nvariants_].name = "sse2";
+    variants_[nvariants_++].sum = chksum_sum_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    variants_[nvariants_].name = "avx2";
+    variants_[nvariants_++].sum = chksum_sum_avx2;
+  }
+#elif CHKSUM_NEON
+  if (chksum_has_neon()) {
+    variants_[nvariants_].name = "neon";
+    variants_[nvariants_++].sum = chksum_sum_neon;
+  }
+#endif
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int fuzz(uint8_t *buf, long rounds) {
+  long i;
+  int v, k;
+  for (i = 0; i < rounds; i++) {
+    /* mostly packet sized, sometimes pbuf sized and now and then just past a lane flush */
+    int len = rand() % (i % 100 == 0 ? 66000 : 2000);
+    if (i % 1000 == 500) {
+      len = CHKSUM_BLOCKS * (i % 2000 == 500 ? 16 : 32) + rand() % 4096;
+    }
+    int off = rand() % 8;
+    int fill = rand() % 3;
+    for (k = 0; k < len + off; k++) {
+      buf[k] = fill == 0 ? (uint8_t)rand() : fill == 1 ? 0xff : 0;
+    }
+    uint16_t want = lwip_chksum_big(buf + off, len);
+    for (v = 0; v < nvariants_; v++) {
+      uint16_t got = len > 0 ? chksum_fold(variants_[v].sum(buf + off, len)) : 0;
+      if (got != want) {
+        printf("%s: len %d offset %d fill %d: got %04x want %04x\n", variants_[v].name, len, off, fill, got, want);
+        return 1;
+      }
+    }
+    if (chksum_fast(buf + off, len) != want) {
+      printf("chksum_fast: len %d offset %d fill %d: got %04x want %04x\n", len, off, fill, chksum_fast(buf + off, len), want);
+      return 1;
+    }
+  }
+  printf("fuzz: %ld rounds, %d routines match lwip_standard_chksum\n", rounds, nvariants_ + 1);
+  return 0;
+}
+
+static void bench(uint8_t *buf, long rounds) {
+  static const int sizes[] = {40, 576, 1500, 9000, 65535};
+  volatile uint32_t sink = 0;
+  size_t s;
+  int v;
+  long i;
+  printf("%-8s %8s %12s\n", "routine", "bytes", "MB/s");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    int len = sizes[s];
+    /* odd offset, the usual case behind an ip header in a pbuf */
+    double t = now_sec();
+    for (i = 0; i < rounds; i++) {
+      sink += lwip_standard_chksum(buf + 1, len);
+    }
+    t = now_sec() - t;
+    printf("%-8s %8d %12.0f\n", "lwip", len, (double)len * rounds / t / 1e6);
+    for (v = 0; v < nvariants_; v++) {
+      t = now_sec();
+      for (i = 0; i < rounds; i++) {
+        sink += chksum_fold(variants_[v].sum(buf + 1, len));
+      }
+      t = now_sec() - t;
+      printf("%-8s %8d %12.0f\n", variants_[v].name, len, (double)len * rounds / t / 1e6);
+    }
+  }
+  (void)sink;
+}
+
+int main(int argc, char **argv) {
+  long fuzz_rounds = argc > 1 ? atol(argv[1]) : 200000;
+  long bench_rounds = argc > 2 ? atol(argv[2]) : 100000;
+  uint8_t *buf = malloc(FUZZ_MAX + 8);
+  int i;
+  if (buf == NULL) {
+    return 1;
+  }
+  srand(1);
+  variants_init();
+  if (fuzz(buf, fuzz_rounds) != 0) {
+    free(buf);
+    return 1;
+  }
+  if (bench_rounds > 0) {
+    for (i = 0; i < 66000 + 8; i++) {
+      buf[i] = (uint8_t)rand();
+    }
+    bench(buf, bench_rounds);
+  }
+  free(buf);
+  return 0;
+}
@@ -0,0 +1,226 @@
+/* Dual-stack comparison through a running tun2call stack, such as tun2echo.
+ *
+ *   tun2call_dualstack [-p port] [-n rounds] [-s bytes] v4addr v6addr
+ *
+ * talks to an echo service behind the tun over both address families and
+ * prints tcp connect time, tcp and udp round trips and tcp echo throughput
+ * side by side, the last column is v6 relative to v4 */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSG_LEN 64
+#define CHUNK 16384
+#define UDP_TIMEOUT_MS 1000
+
+struct result {
+  double connect_us;
+  double tcp_rtt_p50;
+  double tcp_rtt_p99;
+  double udp_rtt_p50;
+  double udp_rtt_p99;
+  int udp_lost;
+  double mbps;
+};
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double pct(double *v, int n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  qsort(v, n, sizeof(double), cmp_double);
+  return v[(int)(p * (n - 1))];
+}
+
+static int resolve(const char *host, const char *port, int type, struct addrinfo **ai) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_NUMERICHOST;
+  int err = getaddrinfo(host, port, &hints, ai);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+    return -1;
+  }
+  return 0;
+}
+
+static int read_full(int fd, char *buf, size_t n) {
+  size_t got = 0;
+  while (got < n) {
+    ssize_t r = read(fd, buf + got, n - got);
+    if (r <= 0) {
+      return -1;
+    }
+    got += r;
+  }
+  return 0;
+}
+
+static int bench_tcp(const char *host, const char *port, int rounds, long bytes, struct result *res, double *rtt) {
+  struct addrinfo *ai;
+  char msg[MSG_LEN], buf[CHUNK];
+  int i, one = 1;
+  if (resolve(host, port, SOCK_STREAM, &ai) != 0) {
+    return -1;
+  }
+  int fd = socket(ai->ai_family, SOCK_STREAM, 0);
+  double t = now_us();
+  if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    perror(host);
+    freeaddrinfo(ai);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  res->connect_us = now_us() - t;
+  freeaddrinfo(ai);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  memset(msg, 'x', sizeof(msg));
+  for (i = 0; i < rounds; i++) {
+    t = now_us();
+    if (write(fd, msg, sizeof(msg)) != sizeof(msg) || read_full(fd, buf, sizeof(msg)) != 0) {
+      fprintf(stderr, "%s: tcp echo failed\n", host);
+      close(fd);
+      return -1;
+    }
+    rtt[i] = now_us() - t;
+  }
+  res->tcp_rtt_p50 = pct(rtt, rounds, 0.5);
+  res->tcp_rtt_p99 = pct(rtt, rounds, 0.99);
+  /* keep writing while draining the echo so neither side's window fills */
+  long sent = 0, recvd = 0;
+  memset(buf, 'y', sizeof(buf));
+  t = now_us();
+  while (recvd < bytes) {
+    struct pollfd pfd = {fd, POLLIN | (sent < bytes ? POLLOUT : 0), 0};
+    if (poll(&pfd, 1, 5000) <= 0) {
+      fprintf(stderr, "%s: tcp throughput stalled\n", host);
+      close(fd);
+      return -1;
+    }
+    if (pfd.revents & POLLOUT) {
+      ssize_t n = write(fd, buf, (size_t)(bytes - sent < CHUNK ? bytes - sent : CHUNK));
+      if (n > 0) {
+        sent += n;
+      }
+    }
+    if (pfd.revents & POLLIN) {
+      char in[CHUNK];
+      ssize_t n = read(fd, in, sizeof(in));
+      if (n <= 0) {
+        fprintf(stderr, "%s: tcp closed\n", host);
+        close(fd);
+        return -1;
+      }
+      recvd += n;
+    }
+  }
+  res->mbps = bytes * 8 / (now_us() - t);
+  close(fd);
+  return 0;
+}
+
+static int bench_udp(const char *host, const char *port, int rounds, struct result *res, double *rtt) {
+  struct addrinfo *ai;
+  char msg[MSG_LEN], buf[MSG_LEN];
+  int i, n = 0;
+  if (resolve(host, port, SOCK_DGRAM, &ai) != 0) {
+    return -1;
+  }
+  int fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+  if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+    perror(host);
+    freeaddrinfo(ai);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  freeaddrinfo(ai);
+  res->udp_lost = 0;
+  for (i = 0; i < rounds; i++) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    snprintf(msg, sizeof(msg), "%d", i);
+    double t = now_us();
+    if (send(fd, msg, sizeof(msg), 0) != sizeof(msg) || poll(&pfd, 1, UDP_TIMEOUT_MS) <= 0 ||
+        recv(fd, buf, sizeof(buf), 0) != sizeof(buf) || memcmp(msg, buf, sizeof(msg)) != 0) {
+      res->udp_lost++;
+      continue;
+    }
+    rtt[n++] = now_us() - t;
+  }
+  res->udp_rtt_p50 = pct(rtt, n, 0.5);
+  res->udp_rtt_p99 = pct(rtt, n, 0.99);
+  close(fd);
+  return 0;
+}
+
+static void row(const char *name, double v4, double v6) {
+  printf("%-16s %12.1f %12.1f %9.2f\n", name, v4, v6, v4 != 0 ? v6 / v4 : 0);
+}
+
+int main(int argc, char **argv) {
+  const char *port = "7";
+  int rounds = 1000, opt;
+  long bytes = 64L << 20;
+  struct result res[2];
+  while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+    if (opt == 'p') {
+      port = optarg;
+    } else if (opt == 'n') {
+      rounds = atoi(optarg);
+    } else if (opt == 's') {
+      bytes = atol(optarg);
+    } else {
+      optind = argc + 1;
+    }
+  }
+  if (argc - optind != 2 || rounds <= 0 || bytes <= 0) {
+    fprintf(stderr, "usage: %s [-p port] [-n rounds] [-s bytes] v4addr v6addr\n", argv[0]);
+    return 2;
+  }
+  double *rtt = malloc(rounds * sizeof(double));
+  if (rtt == NULL) {
+    return 1;
+  }
+  memset(res, 0, sizeof(res));
+  for (int i = 0; i < 2; i++) {
+    const char *host = argv[optind + i];
+    if (bench_tcp(host, port, rounds, bytes, &res[i], rtt) != 0 || bench_udp(host, port, rounds, &res[i], rtt) != 0) {
+      free(rtt);
+      return 1;
+    }
+  }
+  free(rtt);
+  printf("%-16s %12s %12s %9s\n", "", "ipv4", "ipv6", "v6/v4");
+  row("tcp connect us", res[0].connect_us, res[1].connect_us);
+  row("tcp rtt p50 us", res[0].tcp_rtt_p50, res[1].tcp_rtt_p50);
+  row("tcp rtt p99 us", res[0].tcp_rtt_p99, res[1].tcp_rtt_p99);
+  row("tcp echo Mbit/s", res[0].mbps, res[1].mbps);
+  row("udp rtt p50 us", res[0].udp_rtt_p50, res[1].udp_rtt_p50);
+  row("udp rtt p99 us", res[0].udp_rtt_p99, res[1].udp_rtt_p99);
+  row("udp lost", res[0].udp_lost, res[1].udp_lost);
+  return 0;
+}
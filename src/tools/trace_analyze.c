@@ -0,0 +1,333 @@
+/* Offline analyzer for traces recorded with trace_open().
+ *
+ *   tun2call_trace [-f] trace.bin
+ *
+ * prints a per-flow latency breakdown and percentiles over all flows, with -f
+ * it prints folded stacks (flow;phase microseconds) for flamegraph.pl instead */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tun2call/trace.h"
+
+enum phases {
+  PHASE_ACCEPT = 0, /* syn to accept */
+  PHASE_RECV,       /* queued for the app until consumed */
+  PHASE_SEND,       /* handed over by the app until tcp_write took it */
+  PHASE_STALL,      /* tcp_write ERR_MEM until the next write */
+  PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {"accept", "recv_queue", "send_queue", "mem_stall"};
+
+struct chunk {
+  uint64_t ns;
+  uint32_t bytes;
+};
+
+struct fifo {
+  struct chunk *chunks;
+  size_t head;
+  size_t len;
+  size_t cap;
+};
+
+struct samples {
+  uint64_t *ns;
+  size_t len;
+  size_t cap;
+};
+
+struct stat {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+struct flow {
+  uint32_t id;
+  int used;
+  int udp;
+  uint64_t syn_ns;
+  uint64_t first_ns;
+  uint64_t last_ns;
+  uint64_t stall_ns;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint32_t dns_hits;
+  struct fifo recvq;
+  struct fifo sendq;
+  struct stat phases[PHASE_MAX];
+};
+
+static struct flow *flows_ = NULL;
+static size_t flows_cap_ = 0;
+static size_t flows_len_ = 0;
+static struct samples samples_[PHASE_MAX];
+
+static void *xrealloc(void *p, size_t n) {
+  p = realloc(p, n);
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+static struct flow *flow_get(uint32_t id) {
+  size_t i;
+  if (flows_len_ * 2 >= flows_cap_) {
+    struct flow *old = flows_;
+    size_t old_cap = flows_cap_;
+    flows_cap_ = flows_cap_ ? flows_cap_ * 2 : 1024;
+    flows_ = calloc(flows_cap_, sizeof(struct flow));
+    if (flows_ == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (i = 0; i < old_cap; i++) {
+      if (old[i].used) {
+        size_t j = (old[i].id * 2654435761u) % flows_cap_;
+        while (flows_[j].used) {
+          j = (j + 1) % flows_cap_;
+        }
+        flows_[j] = old[i];
+      }
+    }
+    free(old);
+  }
+  i = (id * 2654435761u) % flows_cap_;
+  while (flows_[i].used && flows_[i].id != id) {
+    i = (i + 1) % flows_cap_;
+  }
+  if (!flows_[i].used) {
+    flows_[i].used = 1;
+    flows_[i].id = id;
+    flows_len_++;
+  }
+  return &flows_[i];
+}
+
+static void fifo_push(struct fifo *q, uint64_t ns, uint32_t bytes) {
+  if (q->len == q->cap) {
+    size_t i, cap = q->cap ? q->cap * 2 : 16;
+    struct chunk *chunks = xrealloc(NULL, cap * sizeof(struct chunk));
+    for (i = 0; i < q->len; i++) {
+      chunks[i] = q->chunks[(q->head + i) % q->cap];
+    }
+    free(q->chunks);
+    q->chunks = chunks;
+    q->head = 0;
+    q->cap = cap;
+  }
+  q->chunks[(q->head + q->len) % q->cap].ns = ns;
+  q->chunks[(q->head + q->len) % q->cap].bytes = bytes;
+  q->len++;
+}
+
+static void record(struct flow *f, int phase, uint64_t ns) {
+  struct stat *st = &f->phases[phase];
+  struct samples *s = &samples_[phase];
+  st->count++;
+  st->sum += ns;
+  if (ns > st->max) {
+    st->max = ns;
+  }
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->ns = xrealloc(s->ns, s->cap * sizeof(uint64_t));
+  }
+  s->ns[s->len++] = ns;
+}
+
+/* take bytes off the head of q, one sample per chunk touched */
+static void fifo_pop(struct flow *f, struct fifo *q, int phase, uint64_t now, uint32_t bytes) {
+  while (bytes > 0 && q->len > 0) {
+    struct chunk *c = &q->chunks[q->head];
+    uint32_t n = bytes < c->bytes ? bytes : c->bytes;
+    record(f, phase, now - c->ns);
+    c->bytes -= n;
+    bytes -= n;
+    if (c->bytes == 0) {
+      q->head = (q->head + 1) % q->cap;
+      q->len--;
+    }
+  }
+}
+
+static void handle(const struct trace_record *r) {
+  struct flow *f;
+  if (r->event >= TRACE_NETIF_INPUT) {
+    return;
+  }
+  f = flow_get(r->flow);
+  if (f->first_ns == 0) {
+    f->first_ns = r->ns;
+  }
+  f->last_ns = r->ns;
+  switch (r->event) {
+  case TRACE_TCP_SYN:
+    f->syn_ns = r->ns;
+    break;
+  case TRACE_TCP_ACCEPT:
+    if (f->syn_ns != 0) {
+      record(f, PHASE_ACCEPT, r->ns - f->syn_ns);
+    }
+    break;
+  case TRACE_TCP_RECV:
+    f->bytes_in += r->arg;
+    fifo_push(&f->recvq, r->ns, r->arg);
+    break;
+  case TRACE_TCP_CONSUME:
+    fifo_pop(f, &f->recvq, PHASE_RECV, r->ns, r->arg);
+    break;
+  case TRACE_TCP_SEND_BUF:
+    fifo_push(&f->sendq, r->ns, r->arg);
+    break;
+  case TRACE_TCP_WRITE:
+    f->bytes_out += r->arg;
+    if (f->stall_ns != 0) {
+      record(f, PHASE_STALL, r->ns - f->stall_ns);
+      f->stall_ns = 0;
+    }
+    fifo_pop(f, &f->sendq, PHASE_SEND, r->ns, r->arg);
+    break;
+  case TRACE_TCP_WRITE_MEM:
+    if (f->stall_ns == 0) {
+      f->stall_ns = r->ns;
+    }
+    break;
+  case TRACE_TCP_CLOSE:
+    /* flow ids are 4-tuple hashes, a reused tuple starts over */
+    f->syn_ns = 0;
+    f->stall_ns = 0;
+    f->recvq.len = 0;
+    f->sendq.len = 0;
+    break;
+  case TRACE_UDP_RECV:
+    f->udp = 1;
+    f->bytes_in += r->arg;
+    break;
+  case TRACE_UDP_SEND:
+    f->udp = 1;
+    f->bytes_out += r->arg;
+    break;
+  case TRACE_UDP_DNS_HIT:
+    f->udp = 1;
+    f->dns_hits++;
+    break;
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double us(uint64_t ns) {
+  return ns / 1000.0;
+}
+
+static double pct(struct samples *s, double p) {
+  if (s->len == 0) {
+    return 0;
+  }
+  return us(s->ns[(size_t)(p * (s->len - 1))]);
+}
+
+static void print_report(uint64_t netif_in, uint64_t netif_out, uint64_t throttled) {
+  size_t i;
+  int p;
+  printf("%-10s %-4s %10s %10s %10s %10s %10s %7s %10s %12s %12s %10s\n", "flow", "kind", "accept_us", "recv_avg", "recv_max",
+         "send_avg", "send_max", "stalls", "stall_us", "bytes_in", "bytes_out", "dur_ms");
+  for (i = 0; i < flows_cap_; i++) {
+    struct flow *f = &flows_[i];
+    struct stat *st = f->phases;
+    if (!f->used) {
+      continue;
+    }
+    printf("%08x   %-4s %10.1f %10.1f %10.1f %10.1f %10.1f %7llu %10.1f %12llu %12llu %10.1f\n", f->id, f->udp ? "udp" : "tcp",
+           st[PHASE_ACCEPT].count ? us(st[PHASE_ACCEPT].sum / st[PHASE_ACCEPT].count) : 0,
+           st[PHASE_RECV].count ? us(st[PHASE_RECV].sum / st[PHASE_RECV].count) : 0, us(st[PHASE_RECV].max),
+           st[PHASE_SEND].count ? us(st[PHASE_SEND].sum / st[PHASE_SEND].count) : 0, us(st[PHASE_SEND].max),
+           (unsigned long long)st[PHASE_STALL].count, us(st[PHASE_STALL].sum), (unsigned long long)f->bytes_in,
+           (unsigned long long)f->bytes_out, (f->last_ns - f->first_ns) / 1e6);
+  }
+  printf("\n%-12s %10s %10s %10s %10s %10s\n", "phase", "count", "p50_us", "p90_us", "p99_us", "max_us");
+  for (p = 0; p < PHASE_MAX; p++) {
+    struct samples *s = &samples_[p];
+    qsort(s->ns, s->len, sizeof(uint64_t), cmp_u64);
+    printf("%-12s %10llu %10.1f %10.1f %10.1f %10.1f\n", phase_names[p], (unsigned long long)s->len, pct(s, 0.5), pct(s, 0.9),
+           pct(s, 0.99), s->len ? us(s->ns[s->len - 1]) : 0);
+  }
+  printf("\nnetif: %llu bytes in, %llu bytes out, %llu throttled reads\n", (unsigned long long)netif_in,
+         (unsigned long long)netif_out, (unsigned long long)throttled);
+}
+
+static void print_folded(void) {
+  size_t i;
+  int p;
+  for (i = 0; i < flows_cap_; i++) {
+    struct flow *f = &flows_[i];
+    if (!f->used) {
+      continue;
+    }
+    for (p = 0; p < PHASE_MAX; p++) {
+      if (f->phases[p].sum / 1000 > 0) {
+        printf("tun2call;%s;%08x;%s %llu\n", f->udp ? "udp" : "tcp", f->id, phase_names[p],
+               (unsigned long long)(f->phases[p].sum / 1000));
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  struct trace_header hdr;
+  struct trace_record r;
+  uint64_t netif_in = 0, netif_out = 0, throttled = 0;
+  int folded = 0;
+  const char *path = NULL;
+  FILE *fp;
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-f") == 0) {
+      folded = 1;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL) {
+    fprintf(stderr, "usage: %s [-f] trace.bin\n", argv[0]);
+    return 2;
+  }
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return 1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION) {
+    fprintf(stderr, "%s: not a tun2call trace\n", path);
+    fclose(fp);
+    return 1;
+  }
+  while (fread(&r, sizeof(r), 1, fp) == 1) {
+    if (r.event == TRACE_NETIF_INPUT) {
+      netif_in += r.arg;
+    } else if (r.event == TRACE_NETIF_OUTPUT) {
+      netif_out += r.arg;
+    } else if (r.event == TRACE_NETIF_THROTTLE) {
+      throttled++;
+    } else {
+      handle(&r);
+    }
+  }
+  fclose(fp);
+  if (folded) {
+    print_folded();
+  } else {
+    print_report(netif_in, netif_out, throttled);
+  }
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef ADDR_HASH_H
+#define ADDR_HASH_H
+
+#include "lwip/ip_addr.h"
+
+/* multiplicative hash of an address for the open addressing tables, use the high bits */
+static inline u32_t addr_hash(const ip_addr_t *addr) {
+#if LWIP_IPV6
+  if (IP_IS_V6(addr)) {
+    const u32_t *a = ip_2_ip6(addr)->addr;
+    return (a[0] ^ a[1] ^ a[2] ^ a[3]) * 2654435761u;
+  }
+#endif
+  return ip_2_ip4(addr)->addr * 2654435761u;
+}
+
+#endif
@@ -1,5 +1,9 @@
 
 #include "all_tcp.h"
+#include "addr_hash.h"
+#include "memgov.h"
+#include "trace.h"
+#include "netif.h"
 #include "lwip/api.h"
 #include "lwip/autoip.h"
 #include "lwip/debug.h"
@@ -8,6 +12,7 @@
 #include "lwip/etharp.h"
 #include "lwip/igmp.h"
 #include "lwip/init.h"
+#include "lwip/ip.h"
 #include "lwip/ip4_frag.h"
 #include "lwip/netif.h"
 #include "lwip/opt.h"
@@ -19,9 +24,309 @@
 #include "lwip/udp.h"
 #include "netif/ethernet.h"
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef ALL_TCP_SOURCE_SIZE
+#define ALL_TCP_SOURCE_SIZE 256
+#endif
+
+struct all_tcp_source {
+  ip_addr_t addr;
+  u32_t used;
+  u32_t conns;
+};
+
+/* find the slot of addr, or claim an empty one, NULL when the table is full */
+static struct all_tcp_source *all_tcp_source_get(struct all_tcp_handler *handler, const ip_addr_t *addr) {
+  u32_t i, idx = (addr_hash(addr) >> 16) % ALL_TCP_SOURCE_SIZE;
+  struct all_tcp_source *found = NULL;
+  for (i = 0; i < ALL_TCP_SOURCE_SIZE; i++) {
+    struct all_tcp_source *s = &handler->sources[(idx + i) % ALL_TCP_SOURCE_SIZE];
+    if (!s->used) {
+      if (found == NULL) {
+        found = s;
+      }
+      break;
+    }
+    if (ip_addr_cmp(&s->addr, addr)) {
+      return s;
+    }
+    if (s->conns == 0 && found == NULL) {
+      /* idle slot, reusable if addr is not further down the chain */
+      found = s;
+    }
+  }
+  if (found != NULL) {
+    found->used = 1;
+    found->conns = 0;
+    ip_addr_copy(found->addr, *addr);
+  }
+  return found;
+}
+
+/* token bucket in milli-tokens, refilled by accept_rate per second */
+static int all_tcp_accept_token(struct all_tcp_handler *handler) {
+  if (handler->accept_rate == 0) {
+    return 1;
+  }
+  u32_t burst = (handler->accept_burst ? handler->accept_burst : handler->accept_rate) * 1000;
+  u32_t now = sys_now();
+  u32_t elapsed = now - handler->accept_last;
+  handler->accept_last = now;
+  if (elapsed >= burst / handler->accept_rate) {
+    handler->accept_tokens = burst;
+  } else {
+    handler->accept_tokens = LWIP_MIN(handler->accept_tokens + elapsed * handler->accept_rate, burst);
+  }
+  if (handler->accept_tokens < 1000) {
+    return 0;
+  }
+  handler->accept_tokens -= 1000;
+  return 1;
+}
+
+/* apply the accept limits cheapest first, inflight and inflight_ip count syns handed to the app
+ * but not yet accepted, a syn that got its token at SYN time does not take another */
+static int all_tcp_admit(struct all_tcp_handler *handler, const ip_addr_t *addr, u32_t inflight, u32_t inflight_ip,
+                         int token, struct all_tcp_source **source) {
+  *source = NULL;
+  if (handler->max_conns && handler->conns + inflight >= handler->max_conns) {
+    handler->rejected_conns++;
+    return 0;
+  }
+  if (memgov_level() == MEMGOV_HARD) {
+    handler->rejected_mem++;
+    return 0;
+  }
+  if (handler->max_conns_per_ip && handler->sources != NULL) {
+    *source = all_tcp_source_get(handler, addr);
+    if (*source == NULL || (*source)->conns + inflight_ip >= handler->max_conns_per_ip) {
+      handler->rejected_per_ip++;
+      return 0;
+    }
+  }
+  if (token && !all_tcp_accept_token(handler)) {
+    handler->rejected_rate++;
+    return 0;
+  }
+  return 1;
+}
+
+#ifndef ALL_TCP_SYN_MAX
+#define ALL_TCP_SYN_MAX 64
+#endif
+/* ms a syn may wait for the app's answer, and then for the handshake to finish */
+#ifndef ALL_TCP_SYN_TIMEOUT
+#define ALL_TCP_SYN_TIMEOUT 10000
+#endif
+/* ms between sweeps when no syn arrives to run one */
+#ifndef ALL_TCP_SYN_SWEEP
+#define ALL_TCP_SYN_SWEEP 1000
+#endif
+#define ALL_TCP_FLAG_SYN 0x02
+#define ALL_TCP_FLAG_ACK 0x10
+
+/* free the slot of syn, telling the app it will not become a connection */
+static void all_tcp_syn_drop(struct all_tcp_handler *handler, struct all_tcp_syn *syn) {
+  if (handler->syn_abandon != NULL) {
+    handler->syn_abandon(handler, syn);
+  }
+  if (syn->p != NULL) {
+    pbuf_free(syn->p);
+    syn->p = NULL;
+  }
+  syn->user = NULL;
+  syn->state = SS_NONE;
+}
+
+static void all_tcp_syn_sweep(struct all_tcp_handler *handler, u32_t now) {
+  u32_t i;
+  for (i = 0; i < handler->syn_max; i++) {
+    struct all_tcp_syn *syn = &handler->syns[i];
+    if (syn->state == SS_NONE || now - syn->time < ALL_TCP_SYN_TIMEOUT) {
+      continue;
+    }
+    if (syn->state == SS_PENDING) {
+      /* the app never answered, refuse it rather than swallow every retransmission */
+      tcp_rst(NULL, 0, syn->seqno + 1, &syn->local_ip, &syn->remote_ip, syn->local_port, syn->remote_port);
+    }
+    /* or the client never finished the handshake */
+    all_tcp_syn_drop(handler, syn);
+  }
+}
+
+static void all_tcp_syn_timer(void *arg) {
+  struct all_tcp_handler *handler = arg;
+  all_tcp_syn_sweep(handler, sys_now());
+  sys_timeout(ALL_TCP_SYN_SWEEP, all_tcp_syn_timer, handler);
+}
+
+static struct all_tcp_syn *all_tcp_syn_find(struct all_tcp_handler *handler, const ip_addr_t *local_ip, u16_t local_port,
+                                            const ip_addr_t *remote_ip, u16_t remote_port) {
+  u32_t i;
+  for (i = 0; i < handler->syn_max; i++) {
+    struct all_tcp_syn *syn = &handler->syns[i];
+    if (syn->state != SS_NONE && syn->local_port == local_port && syn->remote_port == remote_port &&
+        ip_addr_cmp(&syn->local_ip, local_ip) && ip_addr_cmp(&syn->remote_ip, remote_ip)) {
+      return syn;
+    }
+  }
+  return NULL;
+}
+
+int all_tcp_syn_filter(void *arg, struct netif *netif, struct pbuf *p) {
+  struct all_tcp_handler *handler = arg;
+  const u8_t *h = p->payload;
+  ip_addr_t src, dst;
+  u16_t off;
+  if (handler->syns == NULL || p->len < 20) {
+    return 0;
+  }
+  if ((h[0] >> 4) == 4) {
+    /* tcp, not a fragment */
+    if (h[9] != IP_PROTO_TCP || (h[6] & 0x3f) != 0 || h[7] != 0) {
+      return 0;
+    }
+    off = (u16_t)((h[0] & 0x0f) * 4);
+    IP_ADDR4(&src, h[12], h[13], h[14], h[15]);
+    IP_ADDR4(&dst, h[16], h[17], h[18], h[19]);
+#if LWIP_IPV6
+  } else if ((h[0] >> 4) == 6) {
+    u32_t w[8];
+    if (p->len < 40 || h[6] != IP6_NEXTH_TCP) {
+      return 0;
+    }
+    off = 40;
+    memcpy(w, h + 8, sizeof(w));
+    IP_ADDR6(&src, w[0], w[1], w[2], w[3]);
+    IP_ADDR6(&dst, w[4], w[5], w[6], w[7]);
+    /* zone link-local addresses like ip6_input does, or they never match the pcb in accept */
+    ip6_addr_assign_zone(ip_2_ip6(&src), IP6_UNKNOWN, netif);
+    ip6_addr_assign_zone(ip_2_ip6(&dst), IP6_UNKNOWN, netif);
+#endif
+  } else {
+    return 0;
+  }
+  if (p->len < off + 14 || (h[off + 13] & (ALL_TCP_FLAG_SYN | ALL_TCP_FLAG_ACK)) != ALL_TCP_FLAG_SYN) {
+    return 0;
+  }
+  u16_t src_port = (u16_t)((h[off] << 8) | h[off + 1]);
+  u16_t dst_port = (u16_t)((h[off + 2] << 8) | h[off + 3]);
+  u32_t seqno = ((u32_t)h[off + 4] << 24) | ((u32_t)h[off + 5] << 16) | ((u32_t)h[off + 6] << 8) | h[off + 7];
+  u32_t now = sys_now();
+  all_tcp_syn_sweep(handler, now);
+  struct all_tcp_syn *syn = all_tcp_syn_find(handler, &dst, dst_port, &src, src_port);
+  if (syn != NULL) {
+    if (syn->state == SS_PENDING) {
+      /* retransmitted syn, the app is still deciding */
+      pbuf_free(p);
+      return 1;
+    }
+    return 0;
+  }
+  struct all_tcp_syn *free_syn = NULL;
+  u32_t inflight = 0, inflight_ip = 0;
+  for (u32_t i = 0; i < handler->syn_max; i++) {
+    if (handler->syns[i].state == SS_NONE) {
+      if (free_syn == NULL) {
+        free_syn = &handler->syns[i];
+      }
+    } else {
+      inflight++;
+      if (ip_addr_cmp(&handler->syns[i].remote_ip, &src)) {
+        inflight_ip++;
+      }
+    }
+  }
+  syn = free_syn;
+  if (syn == NULL) {
+    /* too many undecided, fall back to accepting after the handshake */
+    return 0;
+  }
+  /* refuse over the limits here, before the app starts an upstream connect */
+  struct all_tcp_source *source;
+  if (!all_tcp_admit(handler, &src, inflight, inflight_ip, 1, &source)) {
+    tcp_rst(NULL, 0, seqno + 1, &dst, &src, dst_port, src_port);
+    pbuf_free(p);
+    return 1;
+  }
+  syn->user = NULL;
+  ip_addr_copy(syn->local_ip, dst);
+  ip_addr_copy(syn->remote_ip, src);
+  syn->local_port = dst_port;
+  syn->remote_port = src_port;
+  syn->state = SS_PENDING;
+  syn->netif_idx = netif_get_index(netif);
+  syn->seqno = seqno;
+  syn->time = now;
+  syn->p = p;
+  TRACE(TCP_SYN, TRACE_FLOW_ID(&dst, dst_port, &src, src_port), dst_port);
+  handler->syn(handler, syn);
+  return 1;
+}
+
+void all_tcp_syn_accept(struct all_tcp_handler *handler, struct all_tcp_syn *syn) {
+  if (syn->state != SS_PENDING) {
+    /* answered already or swept, the slot may belong to another syn by now */
+    return;
+  }
+  struct netif *netif = netif_get_by_index(syn->netif_idx);
+  if (netif == NULL) {
+    all_tcp_syn_drop(handler, syn);
+    return;
+  }
+  struct pbuf *p = syn->p;
+  syn->p = NULL;
+  syn->state = SS_ACCEPTED;
+  syn->time = sys_now();
+  /* feed the held syn to lwIP, the handshake starts from here */
+  if (netif->input(p, netif) != ERR_OK) {
+    pbuf_free(p);
+  }
+}
+
+void all_tcp_syn_reject(struct all_tcp_handler *handler, struct all_tcp_syn *syn) {
+  LWIP_UNUSED_ARG(handler);
+  if (syn->state != SS_PENDING) {
+    return;
+  }
+  tcp_rst(NULL, 0, syn->seqno + 1, &syn->local_ip, &syn->remote_ip, syn->local_port, syn->remote_port);
+  pbuf_free(syn->p);
+  syn->p = NULL;
+  syn->state = SS_NONE;
+}
+
+/* bring the governor in line with the chains, the app may have taken them over */
+static void all_tcp_account(struct all_tcp_pcb *es) {
+  u32_t recv = es->recving ? es->recving->tot_len : 0;
+  u32_t send = es->sending ? es->sending->tot_len : 0;
+  memgov_uncharge(MEMGOV_TCP_RECV, es->recv_charged);
+  memgov_charge(MEMGOV_TCP_RECV, recv);
+  es->recv_charged = recv;
+  memgov_uncharge(MEMGOV_TCP_SEND, es->send_charged);
+  memgov_charge(MEMGOV_TCP_SEND, send);
+  es->send_charged = send;
+}
+
+/* trace what the app took out of recving itself, all_tcp_consume traces its own */
+static void all_tcp_trace_taken(struct all_tcp_pcb *es) {
+  u32_t recv = es->recving ? es->recving->tot_len : 0;
+  if (recv < es->recv_charged) {
+    TRACE(TCP_CONSUME, es->id, es->recv_charged - recv);
+  }
+}
 
 static void all_tcp_pcb_free(struct all_tcp_pcb *es) {
   if (es != NULL) {
+    es->handler->conns--;
+    if (es->source != NULL) {
+      es->source->conns--;
+    }
+    if (es->handler->listener == NULL && es->handler->conns == 0) {
+      /* last pcb outliving all_tcp_free */
+      free(es->handler->sources);
+      es->handler->sources = NULL;
+    }
     if (es->sending) {
       /* free the buffer chain if present */
       pbuf_free(es->sending);
@@ -32,6 +337,9 @@ static void all_tcp_pcb_free(struct all_tcp_pcb *es) {
       pbuf_free(es->recving);
       es->recving = NULL;
     }
+    all_tcp_account(es);
+    memgov_uncharge(MEMGOV_TCP_PCB, sizeof(struct all_tcp_pcb));
+    TRACE(TCP_CLOSE, es->id, 0);
     free(es);
   }
 }
@@ -59,6 +367,7 @@ void all_tcp_send(struct all_tcp_pcb *es) {
     /* enqueue data for transmission */
     wr_err = tcp_write(es->raw, ptr->payload, ptr->len, 1);
     if (wr_err == ERR_OK) {
+      TRACE(TCP_WRITE, es->id, ptr->len);
       /* continue with next pbuf in chain (if any) */
       es->sending = ptr->next;
       if (es->sending != NULL) {
@@ -70,12 +379,16 @@ void all_tcp_send(struct all_tcp_pcb *es) {
       pbuf_free(ptr);
     } else if (wr_err == ERR_MEM) {
       /* we are low on memory, try later / harder, defer to poll */
+      TRACE(TCP_WRITE_MEM, es->id, ptr->len);
       es->sending = ptr;
     }
   }
+  all_tcp_trace_taken(es);
+  all_tcp_account(es);
 }
 
 void all_tcp_send_buf(struct all_tcp_pcb *pcb, struct pbuf *buf) {
+  TRACE(TCP_SEND_BUF, pcb->id, buf->tot_len);
   if (pcb->sending) {
     pbuf_cat(pcb->sending, buf);
   } else {
@@ -84,6 +397,53 @@ void all_tcp_send_buf(struct all_tcp_pcb *pcb, struct pbuf *buf) {
   all_tcp_send(pcb);
 }
 
+static void all_tcp_recved_flush(struct all_tcp_pcb *es) {
+  while (es->recved > 0) {
+    u16_t n = (u16_t)LWIP_MIN(es->recved, 0xFFFF);
+    tcp_recved(es->raw, n);
+    es->recved -= n;
+  }
+}
+
+int all_tcp_peek(struct all_tcp_pcb *es, struct iovec *iov, int iovcnt) {
+  struct pbuf *q;
+  int n = 0;
+  for (q = es->recving; q != NULL && n < iovcnt; q = q->next) {
+    if (q->len == 0) {
+      continue;
+    }
+    iov[n].iov_base = q->payload;
+    iov[n].iov_len = q->len;
+    n++;
+  }
+  return n;
+}
+
+void all_tcp_consume(struct all_tcp_pcb *es, u32_t n) {
+  if (es->recving == NULL || n == 0) {
+    return;
+  }
+  if (n >= es->recving->tot_len) {
+    n = es->recving->tot_len;
+    pbuf_free(es->recving);
+    es->recving = NULL;
+  } else {
+    /* frees fully read pbufs and moves the payload of a partial one */
+    es->recving = pbuf_free_header(es->recving, (u16_t)n);
+  }
+  TRACE(TCP_CONSUME, es->id, n);
+  es->recved += n;
+  all_tcp_account(es);
+  /* batch window updates, under memory pressure only once half the window is read */
+  if (memgov_level() != MEMGOV_OK) {
+    if (es->recved >= TCP_WND / 2) {
+      all_tcp_recved_flush(es);
+    }
+  } else if (es->recving == NULL || es->recved >= TCP_WND_UPDATE_THRESHOLD) {
+    all_tcp_recved_flush(es);
+  }
+}
+
 static void all_tcp_error(void *arg, err_t err) {
   LWIP_UNUSED_ARG(err);
   struct all_tcp_pcb *es = arg;
@@ -95,6 +455,9 @@ static err_t all_tcp_poll(void *arg, struct tcp_pcb *pcb) {
   err_t ret_err;
   struct all_tcp_pcb *es = arg;
   if (es != NULL) {
+    if (memgov_level() == MEMGOV_OK) {
+      all_tcp_recved_flush(es);
+    }
     if (es->sending != NULL) {
       /* there is a remaining pbuf (chain)  */
       all_tcp_send(es);
@@ -105,6 +468,8 @@ static err_t all_tcp_poll(void *arg, struct tcp_pcb *pcb) {
       if (es->sending != NULL) {
         all_tcp_send(es);
       }
+      all_tcp_trace_taken(es);
+      all_tcp_account(es);
     }
     ret_err = ERR_OK;
   } else {
@@ -145,6 +510,9 @@ static err_t all_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
     /* cleanup, for unknown reason */
     LWIP_ASSERT("no pbuf expected here", p == NULL);
     ret_err = err;
+  } else if (es->recving != NULL && memgov_level() == MEMGOV_HARD) {
+    /* lwIP holds on to refused data and offers it again later */
+    ret_err = ERR_MEM;
   } else if (es->state == ES_ACCEPTED) {
     /* first data chunk in p->payload */
     es->state = ES_RECEIVED;
@@ -152,7 +520,12 @@ static err_t all_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
     LWIP_ASSERT("es->recving==NULL", es->recving == NULL);
     es->recving = p;
     ret_err = ERR_OK;
+    TRACE(TCP_RECV, es->id, p->tot_len);
+    /* charged before the app sees it, so what it takes over shows against all it had */
+    all_tcp_account(es);
     es->handler->recv(es->handler, es);
+    all_tcp_trace_taken(es);
+    all_tcp_account(es);
   } else if (es->state == ES_RECEIVED) {
     /* read some more data */
     if (es->recving == NULL) {
@@ -161,7 +534,12 @@ static err_t all_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
       pbuf_cat(es->recving, p);
     }
     ret_err = ERR_OK;
+    TRACE(TCP_RECV, es->id, p->tot_len);
+    /* charged before the app sees it, so what it takes over shows against all it had */
+    all_tcp_account(es);
     es->handler->recv(es->handler, es);
+    all_tcp_trace_taken(es);
+    all_tcp_account(es);
   } else {
     /* unknown es->state, trash data  */
     tcp_recved(pcb, p->tot_len);
@@ -172,14 +550,54 @@ static err_t all_tcp_recv(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t
 }
 
 static err_t all_tcp_accept(void *arg, struct tcp_pcb *newpcb, err_t recv_err) {
+  struct all_tcp_handler *handler = arg;
+  struct all_tcp_source *source = NULL;
+  struct all_tcp_syn *syn = NULL;
   if (recv_err != ERR_OK || (newpcb == NULL)) {
     return ERR_VAL;
   }
+  if (handler->syns != NULL) {
+    syn = all_tcp_syn_find(handler, &newpcb->local_ip, newpcb->local_port, &newpcb->remote_ip, newpcb->remote_port);
+    if (syn != NULL && syn->state != SS_ACCEPTED) {
+      syn = NULL;
+    }
+  }
+  /* check limits before allocating anything */
+  if (!all_tcp_admit(handler, &newpcb->remote_ip, 0, 0, syn == NULL, &source)) {
+    if (syn != NULL) {
+      all_tcp_syn_drop(handler, syn);
+    }
+    tcp_abort(newpcb);
+    return ERR_ABRT;
+  }
   struct all_tcp_pcb *es = (struct all_tcp_pcb *) malloc(sizeof(struct all_tcp_pcb));
+  if (es == NULL) {
+    if (syn != NULL) {
+      all_tcp_syn_drop(handler, syn);
+    }
+    tcp_abort(newpcb);
+    return ERR_ABRT;
+  }
+  memgov_charge(MEMGOV_TCP_PCB, sizeof(struct all_tcp_pcb));
+  handler->conns++;
+  if (source != NULL) {
+    source->conns++;
+  }
   es->user = NULL;
+  if (syn != NULL) {
+    es->user = syn->user;
+    syn->user = NULL;
+    syn->state = SS_NONE;
+  }
   es->state = ES_ACCEPTED;
   es->mark = 0;
-  es->handler = arg;
+  es->handler = handler;
+  es->source = source;
+  es->recved = 0;
+  es->recv_charged = 0;
+  es->send_charged = 0;
+  es->id = TRACE_FLOW_ID(&newpcb->local_ip, newpcb->local_port, &newpcb->remote_ip, newpcb->remote_port);
+  TRACE(TCP_ACCEPT, es->id, newpcb->local_port);
   es->raw = newpcb;
   es->sending = NULL;
   es->recving = NULL;
@@ -194,9 +612,53 @@ static err_t all_tcp_accept(void *arg, struct tcp_pcb *newpcb, err_t recv_err) {
   return ERR_OK;
 }
 
+/* accepted pcbs outlive the listener and point into sources, so it goes with the last of them */
+static void all_tcp_tables_free(struct all_tcp_handler *handler) {
+  u32_t i;
+  if (handler->syns != NULL) {
+    sys_untimeout(all_tcp_syn_timer, handler);
+    for (i = 0; i < handler->syn_max; i++) {
+      if (handler->syns[i].state != SS_NONE) {
+        all_tcp_syn_drop(handler, &handler->syns[i]);
+      }
+    }
+  }
+  free(handler->syns);
+  handler->syns = NULL;
+  if (handler->conns == 0) {
+    free(handler->sources);
+    handler->sources = NULL;
+  }
+}
+
 err_t all_tcp_init(struct all_tcp_handler *handler) {
+  handler->accept_tokens = (handler->accept_burst ? handler->accept_burst : handler->accept_rate) * 1000;
+  handler->accept_last = sys_now();
+  handler->syns = NULL;
+  if (handler->syn != NULL) {
+    /* without it the app leaks syn->user of every syn that ends on our side */
+    if (handler->syn_abandon == NULL) {
+      return ERR_ARG;
+    }
+    if (handler->syn_max == 0) {
+      handler->syn_max = ALL_TCP_SYN_MAX;
+    }
+    handler->syns = calloc(handler->syn_max, sizeof(struct all_tcp_syn));
+    if (handler->syns == NULL) {
+      return ERR_MEM;
+    }
+    sys_timeout(ALL_TCP_SYN_SWEEP, all_tcp_syn_timer, handler);
+  }
+  if (handler->max_conns_per_ip && handler->sources == NULL) {
+    handler->sources = calloc(ALL_TCP_SOURCE_SIZE, sizeof(struct all_tcp_source));
+    if (handler->sources == NULL) {
+      all_tcp_tables_free(handler);
+      return ERR_MEM;
+    }
+  }
   handler->listener = tcp_new_ip_type(IPADDR_TYPE_ANY);
   if (handler->listener == NULL) {
+    all_tcp_tables_free(handler);
     return ERR_MEM;
   }
   err_t err;
@@ -204,6 +666,7 @@ err_t all_tcp_init(struct all_tcp_handler *handler) {
   if (err != ERR_OK) {
     tcp_close(handler->listener);
     handler->listener = NULL;
+    all_tcp_tables_free(handler);
     return err;
   }
   handler->listener = tcp_listen(handler->listener);
@@ -216,6 +679,7 @@ err_t all_tcp_free(struct all_tcp_handler *handler) {
   err_t err = tcp_close(handler->listener);
   tcp_shutdown(handler->listener, 0, 0);
   handler->listener = 0;
+  all_tcp_tables_free(handler);
   return err;
 }
 
@@ -223,4 +687,16 @@ void all_tcp_select(struct all_tcp_handler *handler) {
   if (handler->select) {
     return handler->select(handler);
   }
-}
\ No newline at end of file
+}
+
+void all_tcp_set_class(struct all_tcp_pcb *pcb, int cls) {
+  pcb->raw->tos = netif_class_tos(cls);
+  /* interactive pcbs are also the last lwIP kills when it runs out of pcbs */
+  if (cls == NETIF_CLASS_INTERACTIVE) {
+    tcp_setprio(pcb->raw, TCP_PRIO_MAX);
+  } else if (cls == NETIF_CLASS_BULK) {
+    tcp_setprio(pcb->raw, TCP_PRIO_MIN);
+  } else {
+    tcp_setprio(pcb->raw, TCP_PRIO_NORMAL);
+  }
+}
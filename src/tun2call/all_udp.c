@@ -1,49 +1,205 @@
 #include "all_udp.h"
+#include "addr_hash.h"
+#include "dns_cache.h"
+#include "memgov.h"
+#include "trace.h"
+#include "netif.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ALL_UDP_DNS_PORT 53
+
+static err_t all_udp_send(struct all_udp_handler *handler, const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr,
+                          u16_t remote_port, struct pbuf *p);
+
+static int all_udp_dns_answer(struct all_udp_handler *handler, struct udp_pcb *pcb, const ip_addr_t *addr, u16_t port, struct pbuf *p) {
+  ip_addr_t server = pcb->local_ip;
+  struct pbuf *r = dns_cache_lookup(handler->dns_cache, &server, p);
+  if (r == NULL) {
+    handler->dns_misses++;
+    return 0;
+  }
+  handler->dns_hits++;
+  TRACE(UDP_DNS_HIT, TRACE_FLOW_ID(&server, ALL_UDP_DNS_PORT, addr, port), r->tot_len);
+  u8_t tos = handler->listener->tos;
+  handler->listener->tos = netif_class_tos(NETIF_CLASS_INTERACTIVE);
+  all_udp_send(handler, &server, ALL_UDP_DNS_PORT, addr, port, r);
+  handler->listener->tos = tos;
+  pbuf_free(r);
+  pbuf_free(p);
+  return 1;
+}
+
+static int all_udp_same_flow(const struct all_udp_datagram *a, const struct all_udp_datagram *b) {
+  return a->remote_port == b->remote_port && a->local_port == b->local_port &&
+         ip_addr_cmp(&a->remote_addr, &b->remote_addr) && ip_addr_cmp(&a->local_addr, &b->local_addr);
+}
+
+/* make the datagrams of each flow adjacent, keeping arrival order */
+static void all_udp_group(struct all_udp_datagram *dgs, int n) {
+  int i, j;
+  for (i = 1; i < n; i++) {
+    j = i - 1;
+    while (j >= 0 && !all_udp_same_flow(&dgs[j], &dgs[i])) {
+      j--;
+    }
+    if (j >= 0 && j != i - 1) {
+      struct all_udp_datagram dg = dgs[i];
+      memmove(&dgs[j + 2], &dgs[j + 1], (i - j - 1) * sizeof(struct all_udp_datagram));
+      dgs[j + 1] = dg;
+    }
+  }
+}
+
+static void all_udp_flush(struct all_udp_handler *handler) {
+  int n = handler->batch_len;
+  if (n == 0) {
+    return;
+  }
+  handler->batch_len = 0;
+  all_udp_group(handler->batch, n);
+  handler->recv_batch(handler, handler->batch, n);
+}
 
 static void all_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port) {
   struct all_udp_handler *handler = arg;
   if (p != NULL) {
+    u32_t id = TRACE_FLOW_ID(&pcb->local_ip, pcb->local_port, addr, port);
+    TRACE(UDP_RECV, id, p->tot_len);
+    if (handler->dns_cache != NULL && pcb->local_port == ALL_UDP_DNS_PORT && all_udp_dns_answer(handler, pcb, addr, port, p)) {
+      return;
+    }
+    u32_t *seen = &handler->flows[id % ALL_UDP_FLOW_SIZE];
+    if (*seen != id && memgov_level() == MEMGOV_HARD) {
+      /* only flows the app has not seen yet, the ones it has keep going */
+      handler->rejected_mem++;
+      pbuf_free(p);
+      return;
+    }
+    *seen = id;
+    /* held until the app calls all_udp_release */
+    memgov_charge(MEMGOV_UDP, p->tot_len);
+    if (handler->batch != NULL) {
+      struct all_udp_datagram *dg = &handler->batch[handler->batch_len++];
+      ip_addr_copy(dg->local_addr, pcb->local_ip);
+      ip_addr_copy(dg->remote_addr, *addr);
+      dg->local_port = pcb->local_port;
+      dg->remote_port = port;
+      dg->p = p;
+      if (handler->batch_len == handler->batch_max) {
+        all_udp_flush(handler);
+      }
+      return;
+    }
     handler->recv(handler, pcb, addr, port, p);
   }
 }
 
 err_t all_udp_init(struct all_udp_handler *handler) {
   err_t err;
+  handler->batch = NULL;
+  handler->batch_len = 0;
+  if (handler->recv_batch != NULL) {
+    if (handler->batch_max <= 0) {
+      handler->batch_max = ALL_UDP_BATCH_MAX;
+    }
+    handler->batch = malloc(handler->batch_max * sizeof(struct all_udp_datagram));
+    if (handler->batch == NULL) {
+      return ERR_MEM;
+    }
+  }
+  handler->dns_cache = NULL;
+  if (handler->dns_cache_size > 0) {
+    handler->dns_cache = dns_cache_new(handler->dns_cache_size);
+    if (handler->dns_cache == NULL) {
+      free(handler->batch);
+      handler->batch = NULL;
+      return ERR_MEM;
+    }
+  }
   handler->listener = udp_new_ip_type(IPADDR_TYPE_ANY);
   if (handler->listener == NULL) {
+    dns_cache_free(handler->dns_cache);
+    handler->dns_cache = NULL;
+    free(handler->batch);
+    handler->batch = NULL;
     return ERR_MEM;
   }
   err = udp_bind(handler->listener, IP_ANY_TYPE, 0);
   if (err != ERR_OK) {
     udp_remove(handler->listener);
     handler->listener = NULL;
+    dns_cache_free(handler->dns_cache);
+    handler->dns_cache = NULL;
+    free(handler->batch);
+    handler->batch = NULL;
     return err;
   }
   udp_recv(handler->listener, all_udp_recv, handler);
+  memset(handler->routes, 0, sizeof(handler->routes));
+  memset(handler->flows, 0, sizeof(handler->flows));
   return ERR_OK;
 }
 
 void all_udp_free(struct all_udp_handler *handler) {
   udp_remove(handler->listener);
   handler->listener = 0;
+  dns_cache_free(handler->dns_cache);
+  handler->dns_cache = NULL;
+  while (handler->batch_len > 0) {
+    struct pbuf *p = handler->batch[--handler->batch_len].p;
+    memgov_uncharge(MEMGOV_UDP, p->tot_len);
+    pbuf_free(p);
+  }
+  free(handler->batch);
+  handler->batch = NULL;
+}
+
+void all_udp_release(struct all_udp_handler *handler, struct pbuf *p) {
+  LWIP_UNUSED_ARG(handler);
+  memgov_uncharge(MEMGOV_UDP, p->tot_len);
 }
 
 int all_udp_poll(struct all_udp_handler *handler) {
+  /* everything the last netif_default_poll pass read */
+  all_udp_flush(handler);
   if (handler->poll) {
     return handler->poll(handler, handler->listener);
   }
   return 0;
 }
 
-static struct netif *all_udp_get_current_netif(struct udp_pcb *pcb, const ip_addr_t *dst_ip, u16_t dst_port) {
+/* ip6_route walks every address of every netif, remember its answer per src/dst pair */
+static struct netif *all_udp_route(struct all_udp_handler *handler, struct udp_pcb *pcb, const ip_addr_t *dst_ip) {
+  u32_t h = addr_hash(&pcb->local_ip) ^ addr_hash(dst_ip);
+  struct all_udp_route *r = &handler->routes[(h >> 16) % ALL_UDP_ROUTE_SIZE];
+  struct netif *netif;
+  if (r->netif_idx != NETIF_NO_INDEX && ip_addr_cmp(&r->dst, dst_ip) && ip_addr_cmp(&r->src, &pcb->local_ip)) {
+    netif = netif_get_by_index(r->netif_idx);
+    if (netif != NULL && netif_is_up(netif) && netif_is_link_up(netif)) {
+      return netif;
+    }
+  }
+  netif = ip_route(&pcb->local_ip, dst_ip);
+  if (netif != NULL) {
+    ip_addr_copy(r->src, pcb->local_ip);
+    ip_addr_copy(r->dst, *dst_ip);
+    r->netif_idx = netif_get_index(netif);
+  } else {
+    r->netif_idx = NETIF_NO_INDEX;
+  }
+  return netif;
+}
+
+static struct netif *all_udp_get_current_netif(struct all_udp_handler *handler, struct udp_pcb *pcb, const ip_addr_t *dst_ip, u16_t dst_port) {
   struct netif *netif;
   LWIP_UNUSED_ARG(dst_port);
 
   if (pcb->netif_idx != NETIF_NO_INDEX) {
     netif = netif_get_by_index(pcb->netif_idx);
   } else {
-#if LWIP_MULTICAST_TX_OPTIONS
     netif = NULL;
+#if LWIP_MULTICAST_TX_OPTIONS
     if (ip_addr_ismulticast(dst_ip)) {
       /* For IPv6, the interface to use for packets with a multicast destination
        * is specified using an interface index. The same approach may be used
@@ -73,26 +229,75 @@ static struct netif *all_udp_get_current_netif(struct udp_pcb *pcb, const ip_add
       }
 #endif /* LWIP_IPV4 */
     }
-
-    if (netif == NULL)
 #endif /* LWIP_MULTICAST_TX_OPTIONS */
-    {
+#if LWIP_IPV6 && LWIP_IPV6_SCOPES
+    if (netif == NULL && IP_IS_V6(dst_ip) && ip6_addr_has_zone(ip_2_ip6(dst_ip))) {
+      /* scoped destinations such as link-local ones name their interface */
+      netif = netif_get_by_index(ip6_addr_zone(ip_2_ip6(dst_ip)));
+    }
+#endif /* LWIP_IPV6 && LWIP_IPV6_SCOPES */
+    if (netif == NULL) {
       /* find the outgoing network interface for this packet */
-      netif = ip_route(&pcb->local_ip, dst_ip);
+      netif = all_udp_route(handler, pcb, dst_ip);
     }
   }
   return netif;
 }
 
-err_t all_udp_sendto(struct all_udp_handler *handler, const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr,
-                     u16_t remote_port, struct pbuf *p) {
+static err_t all_udp_send(struct all_udp_handler *handler, const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr,
+                          u16_t remote_port, struct pbuf *p) {
   ip_addr_t old_addr = handler->listener->local_ip;
   u16_t old_port = handler->listener->local_port;
   handler->listener->local_ip = *local_addr;
   handler->listener->local_port = local_port;
-  struct netif *netif = all_udp_get_current_netif(handler->listener, remote_addr, remote_port);
+  struct netif *netif = all_udp_get_current_netif(handler, handler->listener, remote_addr, remote_port);
+  TRACE(UDP_SEND, TRACE_FLOW_ID(local_addr, local_port, remote_addr, remote_port), p->tot_len);
   err_t err = udp_sendto_if_src(handler->listener, p, remote_addr, remote_port, netif, &handler->listener->local_ip);
   handler->listener->local_ip = old_addr;
   handler->listener->local_port = old_port;
   return err;
-}
\ No newline at end of file
+}
+
+err_t all_udp_sendto(struct all_udp_handler *handler, const ip_addr_t *local_addr, u16_t local_port, const ip_addr_t *remote_addr,
+                     u16_t remote_port, struct pbuf *p) {
+  if (handler->dns_cache != NULL && local_port == ALL_UDP_DNS_PORT) {
+    /* an upstream answer relayed by the app */
+    dns_cache_store(handler->dns_cache, local_addr, p);
+  }
+  return all_udp_send(handler, local_addr, local_port, remote_addr, remote_port, p);
+}
+
+err_t all_udp_sendto_class(struct all_udp_handler *handler, int cls, const ip_addr_t *local_addr, u16_t local_port,
+                           const ip_addr_t *remote_addr, u16_t remote_port, struct pbuf *p) {
+  u8_t old_tos = handler->listener->tos;
+  handler->listener->tos = netif_class_tos(cls);
+  err_t err = all_udp_sendto(handler, local_addr, local_port, remote_addr, remote_port, p);
+  handler->listener->tos = old_tos;
+  return err;
+}
+
+int all_udp_sendto_batch(struct all_udp_handler *handler, struct all_udp_datagram *dgs, int n) {
+  ip_addr_t old_addr = handler->listener->local_ip;
+  u16_t old_port = handler->listener->local_port;
+  struct netif *netif = NULL;
+  int i;
+  for (i = 0; i < n; i++) {
+    struct all_udp_datagram *dg = &dgs[i];
+    if (i == 0 || !all_udp_same_flow(dg, &dgs[i - 1])) {
+      /* route once per run of the same flow */
+      handler->listener->local_ip = dg->local_addr;
+      handler->listener->local_port = dg->local_port;
+      netif = all_udp_get_current_netif(handler, handler->listener, &dg->remote_addr, dg->remote_port);
+    }
+    if (handler->dns_cache != NULL && dg->local_port == ALL_UDP_DNS_PORT) {
+      dns_cache_store(handler->dns_cache, &dg->local_addr, dg->p);
+    }
+    TRACE(UDP_SEND, TRACE_FLOW_ID(&dg->local_addr, dg->local_port, &dg->remote_addr, dg->remote_port), dg->p->tot_len);
+    if (udp_sendto_if_src(handler->listener, dg->p, &dg->remote_addr, dg->remote_port, netif, &handler->listener->local_ip) != ERR_OK) {
+      break;
+    }
+  }
+  handler->listener->local_ip = old_addr;
+  handler->listener->local_port = old_port;
+  return i;
+}
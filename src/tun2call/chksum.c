@@ -0,0 +1,160 @@
+
+#include "chksum.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHKSUM_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__arm__)
+/* in chksum_neon.c, built with neon enabled even where the abi does not require it */
+#define CHKSUM_NEON 1
+#include "chksum_neon.h"
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+/* vector lanes take at most two 16 bit words per block, flush before 32 bit overflow */
+#define CHKSUM_BLOCKS 0x4000
+/* below this the vector setup costs more than it saves */
+#define CHKSUM_MIN_VECTOR 64
+
+#define CHKSUM_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef uint64_t (*chksum_sum_fn)(const uint8_t *p, int len);
+
+static uint16_t chksum_fold(uint64_t sum) {
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (uint16_t)sum;
+}
+
+/* sums native 16 bit words in memory order, an odd trailing byte is the first
+ * byte of a zero padded word, exactly like lwip_standard_chksum */
+static uint64_t chksum_tail(const uint8_t *p, int len, uint64_t sum) {
+  uint64_t v;
+  uint16_t w;
+  while (len >= 8) {
+    memcpy(&v, p, 8);
+    sum += (v & 0xffffffff) + (v >> 32);
+    p += 8;
+    len -= 8;
+  }
+  while (len >= 2) {
+    memcpy(&w, p, 2);
+    sum += w;
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    w = 0;
+    ((uint8_t *)&w)[0] = *p;
+    sum += w;
+  }
+  return sum;
+}
+
+static uint64_t chksum_sum_scalar(const uint8_t *p, int len) {
+  return chksum_tail(p, len, 0);
+}
+
+#if CHKSUM_X86
+__attribute__((target("sse2"))) static uint64_t chksum_sum_sse2(const uint8_t *p, int len) {
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t sum = 0, t[2];
+  while (len >= 16) {
+    __m128i acc = zero;
+    int n = CHKSUM_MIN(len / 16, CHKSUM_BLOCKS);
+    len -= n * 16;
+    for (; n > 0; n--) {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+      p += 16;
+    }
+    acc = _mm_add_epi64(_mm_unpacklo_epi32(acc, zero), _mm_unpackhi_epi32(acc, zero));
+    _mm_storeu_si128((__m128i *)t, acc);
+    sum += t[0] + t[1];
+  }
+  return chksum_tail(p, len, sum);
+}
+
+__attribute__((target("avx2"))) static uint64_t chksum_sum_avx2(const uint8_t *p, int len) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t sum = 0, t[2];
+  while (len >= 32) {
+    __m256i acc = zero;
+    int n = CHKSUM_MIN(len / 32, CHKSUM_BLOCKS);
+    len -= n * 32;
+    for (; n > 0; n--) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)p);
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+      p += 32;
+    }
+    acc = _mm256_add_epi64(_mm256_unpacklo_epi32(acc, zero), _mm256_unpackhi_epi32(acc, zero));
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    _mm_storeu_si128((__m128i *)t, half);
+    sum += t[0] + t[1];
+  }
+  return chksum_tail(p, len, sum);
+}
+#endif
+
+#if CHKSUM_NEON
+static uint64_t chksum_sum_neon(const uint8_t *p, int len) {
+  int n = len & ~15;
+  return chksum_tail(p + n, len - n, chksum_neon_blocks(p, n));
+}
+
+static int chksum_has_neon(void) {
+#if defined(__aarch64__)
+  return 1;
+#elif defined(__linux__)
+  /* armeabi-v7a does not guarantee neon */
+  return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  return 1;
+#else
+  return 0;
+#endif
+}
+#endif
+
+static chksum_sum_fn chksum_select(void) {
+#if CHKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return chksum_sum_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return chksum_sum_sse2;
+  }
+#elif CHKSUM_NEON
+  if (chksum_has_neon()) {
+    return chksum_sum_neon;
+  }
+#endif
+  return chksum_sum_scalar;
+}
+
+static uint64_t chksum_sum_resolve(const uint8_t *p, int len);
+/* selected on first use, racing threads all store the same value */
+static chksum_sum_fn chksum_sum = chksum_sum_resolve;
+
+static uint64_t chksum_sum_resolve(const uint8_t *p, int len) {
+  chksum_sum = chksum_select();
+  return chksum_sum(p, len);
+}
+
+uint16_t chksum_fast(const void *dataptr, int len) {
+  if (len < CHKSUM_MIN_VECTOR) {
+    return len > 0 ? chksum_fold(chksum_tail(dataptr, len, 0)) : 0;
+  }
+  return chksum_fold(chksum_sum(dataptr, len));
+}
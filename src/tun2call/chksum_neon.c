@@ -0,0 +1,30 @@
+
+#if defined(__aarch64__) || defined(__arm__)
+
+#if !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+#error "chksum_neon.c must be built with neon enabled, -mfpu=neon on 32 bit arm"
+#endif
+
+#include "chksum_neon.h"
+#include <arm_neon.h>
+
+/* lanes take at most two 16 bit words per block, flush before 32 bit overflow */
+#define CHKSUM_BLOCKS 0x4000
+
+uint64_t chksum_neon_blocks(const uint8_t *p, int len) {
+  uint64_t sum = 0;
+  while (len >= 16) {
+    uint32x4_t acc = vdupq_n_u32(0);
+    int n = len / 16 < CHKSUM_BLOCKS ? len / 16 : CHKSUM_BLOCKS;
+    len -= n * 16;
+    for (; n > 0; n--) {
+      acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(p)));
+      p += 16;
+    }
+    uint64x2_t s = vpaddlq_u32(acc);
+    sum += vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+  }
+  return sum;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef CHKSUM_NEON_H
+#define CHKSUM_NEON_H
+
+#include <stdint.h>
+
+/* sum of the native 16 bit words in the whole 16 byte blocks of len, built on
+ * its own with neon enabled, on 32 bit arm only call it when the cpu has neon */
+uint64_t chksum_neon_blocks(const uint8_t *p, int len);
+
+#endif
@@ -0,0 +1,342 @@
+
+#include "dns_cache.h"
+#include "memgov.h"
+#include "lwip/sys.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DNS_CACHE_MSG_MAX 1500
+#define DNS_CACHE_NAME_MAX 255
+#define DNS_CACHE_TTL_MAX 32    /* records per cached message */
+#define DNS_CACHE_TTL_CAP 3600  /* seconds */
+#define DNS_PLAIN_MAX 512       /* largest answer a client without EDNS takes */
+#define DNS_EDNS_SIZE 1232      /* udp payload size put in the opt record of cached answers */
+#define DNS_HDR_LEN 12
+#define DNS_OPT_LEN 11          /* opt record without options */
+#define DNS_TYPE_OPT 41
+#define DNS_FLAG_CD 0x10        /* checking disabled, third header byte */
+#define DNS_OPT_DO 0x8000       /* dnssec ok, in the opt record flags */
+/* entry flags, answers differ by them so they are part of the key */
+#define DNS_CACHE_CD 0x01
+#define DNS_CACHE_DO 0x02
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+struct dns_cache_entry {
+  u32_t hash;
+  ip_addr_t server;
+  u16_t qtype;
+  u16_t qclass;
+  u8_t flags;
+  u8_t qname_len;
+  u8_t qname[DNS_CACHE_NAME_MAX];
+  u32_t stored; /* sys_now() at store */
+  u32_t ttl;    /* seconds */
+  u16_t ttl_count;
+  u16_t ttl_off[DNS_CACHE_TTL_MAX];
+  u16_t len;
+  u8_t *msg; /* kept without its opt record, lookup adds one when the query had it */
+};
+
+struct dns_cache {
+  int size;
+  struct dns_cache_entry *entries;
+};
+
+struct dns_question {
+  u8_t name[DNS_CACHE_NAME_MAX];
+  u8_t name_len;
+  u16_t type;
+  u16_t klass;
+  u16_t end; /* offset after the question */
+};
+
+static u16_t dns_get16(const u8_t *p) {
+  return (u16_t)((p[0] << 8) | p[1]);
+}
+
+static void dns_put16(u8_t *p, u16_t v) {
+  p[0] = (u8_t)(v >> 8);
+  p[1] = (u8_t)v;
+}
+
+static u32_t dns_get32(const u8_t *p) {
+  return ((u32_t)p[0] << 24) | ((u32_t)p[1] << 16) | ((u32_t)p[2] << 8) | p[3];
+}
+
+static void dns_put32(u8_t *p, u32_t v) {
+  p[0] = (u8_t)(v >> 24);
+  p[1] = (u8_t)(v >> 16);
+  p[2] = (u8_t)(v >> 8);
+  p[3] = (u8_t)v;
+}
+
+/* parse the single uncompressed question, names are lowercased for matching */
+static int dns_parse_question(const u8_t *msg, u16_t len, struct dns_question *q) {
+  u16_t off = DNS_HDR_LEN;
+  q->name_len = 0;
+  while (off < len && msg[off] != 0) {
+    u8_t label = msg[off];
+    if ((label & 0xc0) != 0 || off + 1 + label > len || q->name_len + 1 + label > DNS_CACHE_NAME_MAX) {
+      return -1;
+    }
+    q->name[q->name_len++] = label;
+    for (off++; label > 0; label--, off++) {
+      u8_t c = msg[off];
+      q->name[q->name_len++] = (c >= 'A' && c <= 'Z') ? (u8_t)(c + 32) : c;
+    }
+  }
+  if (off + 5 > len) {
+    return -1;
+  }
+  off++;
+  q->type = dns_get16(msg + off);
+  q->klass = dns_get16(msg + off + 2);
+  q->end = (u16_t)(off + 4);
+  return 0;
+}
+
+/* skip a possibly compressed name, returns the offset after it or 0 */
+static u16_t dns_skip_name(const u8_t *msg, u16_t len, u16_t off) {
+  while (off < len) {
+    u8_t label = msg[off];
+    if (label == 0) {
+      return (u16_t)(off + 1);
+    }
+    if ((label & 0xc0) == 0xc0) {
+      return off + 2 <= len ? (u16_t)(off + 2) : 0;
+    }
+    if ((label & 0xc0) != 0) {
+      return 0;
+    }
+    off = (u16_t)(off + 1 + label);
+  }
+  return 0;
+}
+
+/* offset of the type of the opt record among the records from off, 0 without one, -1 when malformed */
+static int dns_find_opt(const u8_t *msg, u16_t len, u16_t off, int records) {
+  for (; records > 0; records--) {
+    off = dns_skip_name(msg, len, off);
+    if (off == 0 || off + 10 > len) {
+      return -1;
+    }
+    if (dns_get16(msg + off) == DNS_TYPE_OPT) {
+      return off;
+    }
+    off = (u16_t)(off + 10 + dns_get16(msg + off + 8));
+  }
+  return off > len ? -1 : 0;
+}
+
+static u32_t dns_hash(const ip_addr_t *server, const struct dns_question *q, u8_t flags) {
+  u32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < q->name_len; i++) {
+    h = (h ^ q->name[i]) * 16777619u;
+  }
+  h = (h ^ q->type) * 16777619u;
+  h = (h ^ q->klass) * 16777619u;
+  h = (h ^ flags) * 16777619u;
+#if LWIP_IPV6
+  if (IP_IS_V6(server)) {
+    const u32_t *a = ip_2_ip6(server)->addr;
+    return (h ^ a[0] ^ a[1] ^ a[2] ^ a[3]) * 16777619u;
+  }
+#endif
+  return (h ^ ip_2_ip4(server)->addr) * 16777619u;
+}
+
+static int dns_entry_match(const struct dns_cache_entry *e, u32_t hash, const ip_addr_t *server, const struct dns_question *q,
+                           u8_t flags) {
+  return e->msg != NULL && e->hash == hash && e->qtype == q->type && e->qclass == q->klass && e->flags == flags &&
+         e->qname_len == q->name_len && memcmp(e->qname, q->name, q->name_len) == 0 &&
+         ip_addr_cmp(&e->server, server);
+}
+
+static void dns_entry_clear(struct dns_cache_entry *e) {
+  if (e->msg != NULL) {
+    memgov_uncharge(MEMGOV_DNS, e->len);
+  }
+  free(e->msg);
+  e->msg = NULL;
+}
+
+struct dns_cache *dns_cache_new(int size) {
+  struct dns_cache *cache = malloc(sizeof(struct dns_cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+  cache->size = size;
+  cache->entries = calloc(size, sizeof(struct dns_cache_entry));
+  if (cache->entries == NULL) {
+    free(cache);
+    return NULL;
+  }
+  memgov_charge(MEMGOV_DNS, size * sizeof(struct dns_cache_entry));
+  return cache;
+}
+
+void dns_cache_free(struct dns_cache *cache) {
+  int i;
+  if (cache == NULL) {
+    return;
+  }
+  for (i = 0; i < cache->size; i++) {
+    dns_entry_clear(&cache->entries[i]);
+  }
+  memgov_uncharge(MEMGOV_DNS, cache->size * sizeof(struct dns_cache_entry));
+  free(cache->entries);
+  free(cache);
+}
+
+struct pbuf *dns_cache_lookup(struct dns_cache *cache, const ip_addr_t *server, struct pbuf *q) {
+  u8_t msg[DNS_CACHE_MSG_MAX];
+  struct dns_question question;
+  u16_t len = pbuf_copy_partial(q, msg, sizeof(msg), 0);
+  /* standard queries only */
+  if (len < DNS_HDR_LEN || (msg[2] & 0xf8) != 0 || dns_get16(msg + 4) != 1 || dns_get16(msg + 6) != 0 ||
+      dns_get16(msg + 8) != 0) {
+    return NULL;
+  }
+  if (dns_parse_question(msg, len, &question) != 0) {
+    return NULL;
+  }
+  int opt = dns_find_opt(msg, len, question.end, dns_get16(msg + 10));
+  if (opt < 0 || (opt > 0 && msg[opt + 5] != 0)) {
+    /* malformed or an edns version upstream has to refuse */
+    return NULL;
+  }
+  u8_t flags = (msg[3] & DNS_FLAG_CD) ? DNS_CACHE_CD : 0;
+  if (opt > 0 && (dns_get16(msg + opt + 6) & DNS_OPT_DO)) {
+    flags |= DNS_CACHE_DO;
+  }
+  u32_t hash = dns_hash(server, &question, flags);
+  struct dns_cache_entry *e = &cache->entries[hash % cache->size];
+  if (!dns_entry_match(e, hash, server, &question, flags)) {
+    return NULL;
+  }
+  u32_t elapsed = (sys_now() - e->stored) / 1000;
+  if (elapsed >= e->ttl) {
+    dns_entry_clear(e);
+    return NULL;
+  }
+  /* an answer too big for what the client takes goes upstream to be truncated there */
+  u16_t out_len = (u16_t)(e->len + (opt > 0 ? DNS_OPT_LEN : 0));
+  if (out_len > (opt > 0 ? LWIP_MAX(dns_get16(msg + opt + 2), DNS_PLAIN_MAX) : DNS_PLAIN_MAX)) {
+    return NULL;
+  }
+  struct pbuf *r = pbuf_alloc(PBUF_TRANSPORT, out_len, PBUF_RAM);
+  if (r == NULL) {
+    return NULL;
+  }
+  u8_t *out = r->payload;
+  memcpy(out, e->msg, e->len);
+  /* answer with the query id and recursion desired bit */
+  out[0] = msg[0];
+  out[1] = msg[1];
+  out[2] = (u8_t)((out[2] & 0xfe) | (msg[2] & 0x01));
+  /* and its question as sent, clients randomizing the case of names (0x20) check it */
+  memcpy(out + DNS_HDR_LEN, msg + DNS_HDR_LEN, question.end - DNS_HDR_LEN);
+  for (int i = 0; i < e->ttl_count; i++) {
+    dns_put32(out + e->ttl_off[i], dns_get32(e->msg + e->ttl_off[i]) - elapsed);
+  }
+  if (opt > 0) {
+    /* echo edns with our own payload size, upstream options like cookies are not replayed */
+    u8_t *o = out + e->len;
+    o[0] = 0;
+    dns_put16(o + 1, DNS_TYPE_OPT);
+    dns_put16(o + 3, DNS_EDNS_SIZE);
+    dns_put32(o + 5, (flags & DNS_CACHE_DO) ? DNS_OPT_DO : 0);
+    dns_put16(o + 9, 0);
+    dns_put16(out + 10, (u16_t)(dns_get16(out + 10) + 1));
+  }
+  return r;
+}
+
+void dns_cache_store(struct dns_cache *cache, const ip_addr_t *server, struct pbuf *r) {
+  u8_t msg[DNS_CACHE_MSG_MAX];
+  struct dns_question question;
+  u16_t ttl_off[DNS_CACHE_TTL_MAX];
+  u16_t ttl_count = 0;
+  u32_t ttl = DNS_CACHE_TTL_CAP;
+  if (r->tot_len > sizeof(msg)) {
+    return;
+  }
+  u16_t len = pbuf_copy_partial(r, msg, sizeof(msg), 0);
+  /* standard responses that are not truncated, positive or nxdomain */
+  if (len < DNS_HDR_LEN || (msg[2] & 0xfa) != 0x80 || dns_get16(msg + 4) != 1) {
+    return;
+  }
+  u8_t rcode = msg[3] & 0x0f;
+  if (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN) {
+    return;
+  }
+  if (dns_parse_question(msg, len, &question) != 0) {
+    return;
+  }
+  /* responses echo the cd bit and the do bit of their query */
+  u8_t flags = (msg[3] & DNS_FLAG_CD) ? DNS_CACHE_CD : 0;
+  u16_t opt_start = 0;
+  int records = dns_get16(msg + 6) + dns_get16(msg + 8) + dns_get16(msg + 10);
+  u16_t off = question.end;
+  for (; records > 0; records--) {
+    u16_t start = off;
+    off = dns_skip_name(msg, len, off);
+    if (off == 0 || off + 10 > len) {
+      return;
+    }
+    u16_t type = dns_get16(msg + off);
+    u16_t rdlen = dns_get16(msg + off + 8);
+    if (type == DNS_TYPE_OPT) {
+      /* the opt pseudo record keeps extended rcode and flags where the ttl would be,
+       * it is cut off below so only take it last and without an extended rcode */
+      if (records != 1 || msg[off + 4] != 0) {
+        return;
+      }
+      if (dns_get16(msg + off + 6) & DNS_OPT_DO) {
+        flags |= DNS_CACHE_DO;
+      }
+      opt_start = start;
+    } else {
+      if (ttl_count == DNS_CACHE_TTL_MAX) {
+        return;
+      }
+      ttl_off[ttl_count++] = (u16_t)(off + 4);
+      ttl = LWIP_MIN(ttl, dns_get32(msg + off + 4));
+    }
+    off = (u16_t)(off + 10 + rdlen);
+    if (off > len) {
+      return;
+    }
+  }
+  if (ttl_count == 0 || ttl == 0) {
+    return;
+  }
+  if (opt_start > 0) {
+    len = opt_start;
+    dns_put16(msg + 10, (u16_t)(dns_get16(msg + 10) - 1));
+  }
+  u32_t hash = dns_hash(server, &question, flags);
+  struct dns_cache_entry *e = &cache->entries[hash % cache->size];
+  u8_t *copy = malloc(len);
+  if (copy == NULL) {
+    return;
+  }
+  memcpy(copy, msg, len);
+  dns_entry_clear(e);
+  e->hash = hash;
+  ip_addr_copy(e->server, *server);
+  e->qtype = question.type;
+  e->qclass = question.klass;
+  e->flags = flags;
+  e->qname_len = question.name_len;
+  memcpy(e->qname, question.name, question.name_len);
+  e->stored = sys_now();
+  e->ttl = ttl;
+  e->ttl_count = ttl_count;
+  memcpy(e->ttl_off, ttl_off, ttl_count * sizeof(u16_t));
+  e->len = len;
+  e->msg = copy;
+  memgov_charge(MEMGOV_DNS, len);
+}
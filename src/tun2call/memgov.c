@@ -0,0 +1,68 @@
+
+#include "memgov.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
+
+static u32_t budget_ = 0;
+static u32_t soft_ = 0;
+static u32_t hard_ = 0;
+static u32_t used_[MEMGOV_MAX];
+
+void memgov_set_budget(u32_t budget, u8_t soft_pct, u8_t hard_pct) {
+  budget_ = budget;
+  soft_ = budget / 100 * soft_pct;
+  hard_ = budget / 100 * hard_pct;
+}
+
+void memgov_charge(int subsys, u32_t n) {
+  used_[subsys] += n;
+}
+
+void memgov_uncharge(int subsys, u32_t n) {
+  used_[subsys] -= LWIP_MIN(n, used_[subsys]);
+}
+
+static u32_t memgov_lwip(void) {
+  u32_t used = 0;
+#if MEMP_STATS
+  int i;
+  for (i = 0; i < MEMP_MAX; i++) {
+    used += (u32_t)lwip_stats.memp[i]->used * memp_pools[i]->size;
+  }
+#endif
+#if MEM_STATS
+  used += (u32_t)lwip_stats.mem.used;
+#endif
+  return used;
+}
+
+u32_t memgov_used(int subsys) {
+  if (subsys == MEMGOV_LWIP) {
+    return memgov_lwip();
+  }
+  if (subsys != MEMGOV_MAX) {
+    return used_[subsys];
+  }
+  u32_t total = used_[MEMGOV_TCP_PCB] + used_[MEMGOV_DNS];
+#if MEMP_STATS || MEM_STATS
+  /* held pbufs already show up in the pools */
+  total += memgov_lwip();
+#else
+  total += used_[MEMGOV_TCP_RECV] + used_[MEMGOV_TCP_SEND] + used_[MEMGOV_UDP] + used_[MEMGOV_SCHED];
+#endif
+  return total;
+}
+
+int memgov_level(void) {
+  if (budget_ == 0) {
+    return MEMGOV_OK;
+  }
+  u32_t total = memgov_used(MEMGOV_MAX);
+  if (total >= hard_) {
+    return MEMGOV_HARD;
+  }
+  if (total >= soft_) {
+    return MEMGOV_SOFT;
+  }
+  return MEMGOV_OK;
+}
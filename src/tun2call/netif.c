@@ -1,5 +1,8 @@
 
 #include "netif.h"
+#include "netif_sched.h"
+#include "memgov.h"
+#include "trace.h"
 #include "lwip/api.h"
 #include "lwip/autoip.h"
 #include "lwip/debug.h"
@@ -22,14 +25,34 @@
 #include "netif/etharp.h"
 #include "netif/ethernet.h"
 #include <stdlib.h>
+#include <string.h>
 
-static err_t netif_default_output(struct netif *netif, struct pbuf *p) {
+/* virtio_net_hdr flag asking the kernel to finish the checksum at csum_start + csum_offset */
+#define NETIF_VNET_HDR_F_NEEDS_CSUM 1
+/* checksum field in the tcp header */
+#define NETIF_TCP_CSUM_OFF 16
+
+struct netif_vnet_hdr {
+  u8_t flags;
+  u8_t gso_type;
+  u16_t hdr_len;
+  u16_t gso_size;
+  u16_t csum_start;
+  u16_t csum_offset;
+};
+
+static struct netif *default_ = 0;
+static struct netif_sched *sched_ = 0;
+static u32_t last_read_ = 0;
+
+static err_t netif_default_write(struct netif *netif, struct pbuf *p) {
   struct netif_handler *handler = (struct netif_handler *)netif->state;
   /* signal that packet should be sent(); */
+  TRACE(NETIF_OUTPUT, 0, p->tot_len);
   ssize_t written = handler->write(handler, p);
   if (written < p->tot_len) {
     MIB2_STATS_NETIF_INC(netif, ifoutdiscards);
-    LOG_ERROR("netif_default_output: write");
+    LOG_ERROR("netif_default_write: write");
     return ERR_IF;
   } else {
     MIB2_STATS_NETIF_ADD(netif, ifoutoctets, (u32_t)written);
@@ -37,21 +60,70 @@ static err_t netif_default_output(struct netif *netif, struct pbuf *p) {
   }
 }
 
+static err_t netif_default_output(struct netif *netif, struct pbuf *p) {
+  if (sched_ != NULL) {
+    return netif_sched_enqueue(sched_, p);
+  }
+  return netif_default_write(netif, p);
+}
+
+static void netif_default_drain(struct netif *netif, u32_t rate) {
+  struct pbuf *p;
+  while ((p = netif_sched_dequeue(sched_, rate)) != NULL) {
+    netif_default_write(netif, p);
+    pbuf_free(p);
+  }
+}
+
 static struct pbuf *netif_default_read(struct netif *netif) {
   struct netif_handler *handler = (struct netif_handler *)netif->state;
   struct pbuf *p = handler->read(handler);
   return p;
 }
 
-static void netif_default_input(struct netif *netif) {
+/* returns zero when nothing was read */
+static int netif_default_input(struct netif *netif) {
+  if (memgov_level() == MEMGOV_HARD) {
+    /* over budget, let a packet in per ms so acks still free memory */
+    u32_t now = sys_now();
+    if (now == last_read_) {
+      TRACE(NETIF_THROTTLE, 0, 0);
+      return 0;
+    }
+    last_read_ = now;
+  }
   struct pbuf *p = netif_default_read(netif);
   if (p == NULL) {
-    return;
+    return 0;
+  }
+  TRACE(NETIF_INPUT, 0, p->tot_len);
+  struct netif_handler *handler = (struct netif_handler *)netif->state;
+  if (handler->filter != NULL && handler->filter(handler->filter_arg, netif, p)) {
+    return 1;
   }
   if (netif->input(p, netif) != ERR_OK) {
     pbuf_free(p);
   }
+  return 1;
+}
+
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+static u16_t netif_default_chksum_flags(struct netif_handler *handler) {
+  u16_t flags = NETIF_CHECKSUM_ENABLE_ALL;
+  if (handler->trust_chksum & NETIF_TRUST_CHKSUM_RX) {
+    /* the kernel produced these packets on this host */
+    flags &= ~(NETIF_CHECKSUM_CHECK_IP | NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP |
+               NETIF_CHECKSUM_CHECK_ICMP | NETIF_CHECKSUM_CHECK_ICMP6);
+  }
+  if (handler->trust_chksum & NETIF_TRUST_CHKSUM_TX) {
+    /* the kernel finishes tcp checksums via netif_handler_vnet_hdr, udp ones stay
+     * with lwIP since fragmented datagrams cannot be finished that way and ipv6
+     * requires them, the ip header checksum is always verified by the kernel */
+    flags &= ~NETIF_CHECKSUM_GEN_TCP;
+  }
+  return flags;
 }
+#endif
 
 static err_t netif_default_low_init(struct netif *netif) {
   MIB2_INIT_NETIF(netif, snmp_ifType_other, 100000000);
@@ -60,7 +132,6 @@ static err_t netif_default_low_init(struct netif *netif) {
   netif->output = netif_default_output;
   netif->output_ip6 = netif_default_output;
   netif->linkoutput = netif_default_output;
-  netif->mtu = 1500;
   netif->hwaddr[0] = 0x02;
   netif->hwaddr[1] = 0x12;
   netif->hwaddr[2] = 0x34;
@@ -71,13 +142,19 @@ static err_t netif_default_low_init(struct netif *netif) {
   /* device capabilities */
   netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_IGMP;
   struct netif_handler *handler = netif->state;
+  netif->mtu = handler->mtu ? handler->mtu : 1500;
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  NETIF_SET_CHECKSUM_CTRL(netif, netif_default_chksum_flags(handler));
+#else
+  if (handler->trust_chksum) {
+    LOG_ERROR("netif_default_low_init: trust_chksum needs LWIP_CHECKSUM_CTRL_PER_NETIF\n");
+  }
+#endif
   handler->init(handler, netif);
   netif_set_link_up(netif);
   return ERR_OK;
 }
 
-static struct netif *default_ = 0;
-
 /* globales variables for netifs */
 static void netif_default_status_callback(struct netif *netif) {
   if (netif_is_up(netif)) {
@@ -102,17 +179,121 @@ void netif_handler_set(struct netif_handler *handler, u32_t ipaddr, u32_t netmas
   handler->gw.addr = PP_HTONL(gw);
 }
 
+#if LWIP_IPV6
+err_t netif_handler_add_ip6(struct netif_handler *handler, const ip6_addr_t *ip6addr) {
+  if (handler->ip6count >= NETIF_HANDLER_IP6_MAX) {
+    return ERR_MEM;
+  }
+  ip6_addr_set(&handler->ip6addr[handler->ip6count], ip6addr);
+  handler->ip6count++;
+  return ERR_OK;
+}
+
+static void netif_default_add_ip6(struct netif_handler *handler) {
+  int i;
+  s8_t idx;
+  for (i = 0; i < handler->ip6count; i++) {
+    if (netif_add_ip6_address(default_, &handler->ip6addr[i], &idx) != ERR_OK) {
+      LOG_ERROR("netif_default_add_ip6: no free slot for %s\n", ip6addr_ntoa(&handler->ip6addr[i]));
+      continue;
+    }
+    /* nobody else is on a tun link, skip duplicate address detection */
+    netif_ip6_addr_set_state(default_, idx, IP6_ADDR_PREFERRED);
+    LOG_DEBUG("Starting lwIP, ip6 address is %s\n", ip6addr_ntoa(&handler->ip6addr[i]));
+  }
+}
+
+/* drop the global addresses keep does not list, all of them when keep is NULL */
+static void netif_default_remove_ip6(struct netif_handler *keep) {
+  s8_t idx;
+  int i, count = keep ? keep->ip6count : 0;
+  for (idx = 1; idx < LWIP_IPV6_NUM_ADDRESSES; idx++) {
+    if (!ip6_addr_isvalid(netif_ip6_addr_state(default_, idx))) {
+      continue;
+    }
+    for (i = 0; i < count; i++) {
+      if (ip6_addr_cmp(netif_ip6_addr(default_, idx), &keep->ip6addr[i])) {
+        break;
+      }
+    }
+    if (i == count) {
+      LOG_DEBUG("Updating lwIP, ip6 address %s removed\n", ip6addr_ntoa(netif_ip6_addr(default_, idx)));
+      netif_ip6_addr_set_state(default_, idx, IP6_ADDR_INVALID);
+    }
+  }
+}
+#endif
+
+/* seed the tcp checksum of p with its pseudo header sum and point vh at it */
+static void netif_vnet_csum(struct pbuf *p, struct netif_vnet_hdr *vh) {
+  u8_t *h = p->payload;
+  const u8_t *addrs;
+  u16_t off, len, i, addrs_len;
+  u8_t proto;
+  u32_t sum;
+  if (p->len < 20) {
+    return;
+  }
+  if ((h[0] >> 4) == 4) {
+    off = (u16_t)((h[0] & 0x0f) * 4);
+    proto = h[9];
+    len = (u16_t)(((h[2] << 8) | h[3]) - off);
+    addrs = h + 12;
+    addrs_len = 8;
+  } else if ((h[0] >> 4) == 6 && p->len >= 40) {
+    /* lwIP adds no extension headers to tcp */
+    off = 40;
+    proto = h[6];
+    len = (u16_t)((h[4] << 8) | h[5]);
+    addrs = h + 8;
+    addrs_len = 32;
+  } else {
+    return;
+  }
+  /* lwIP never fragments tcp, segments fit the mss */
+  if (proto != IP_PROTO_TCP || p->len < off + NETIF_TCP_CSUM_OFF + 2) {
+    return;
+  }
+  sum = (u32_t)proto + len;
+  for (i = 0; i < addrs_len; i += 2) {
+    sum += (u32_t)((addrs[i] << 8) | addrs[i + 1]);
+  }
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  /* the kernel adds the sum over the segment from csum_start and stores its complement */
+  h[off + NETIF_TCP_CSUM_OFF] = (u8_t)(sum >> 8);
+  h[off + NETIF_TCP_CSUM_OFF + 1] = (u8_t)sum;
+  vh->flags = NETIF_VNET_HDR_F_NEEDS_CSUM;
+  vh->csum_start = off;
+  vh->csum_offset = NETIF_TCP_CSUM_OFF;
+}
+
+size_t netif_handler_vnet_hdr(struct netif_handler *handler, struct pbuf *p, void *hdr) {
+  struct netif_vnet_hdr vh;
+  memset(&vh, 0, sizeof(vh));
+  if (handler->trust_chksum & NETIF_TRUST_CHKSUM_TX) {
+    netif_vnet_csum(p, &vh);
+  }
+  memcpy(hdr, &vh, NETIF_VNET_HDR_LEN);
+  return NETIF_VNET_HDR_LEN;
+}
+
 /* This function initializes all network interfaces */
 void netif_default_init(struct netif_handler *handler) {
   LOG_DEBUG("Starting lwIP, local interface IP is %s\n",
             ip4addr_ntoa(&handler->ipaddr));
   default_ = malloc(sizeof(struct netif));
+  if (handler->enable_sched) {
+    sched_ = malloc(sizeof(struct netif_sched));
+    netif_sched_init(sched_);
+  }
   netif_add(default_, &handler->ipaddr, &handler->netmask, &handler->gw,
             handler, netif_default_low_init, netif_input);
   if (handler->enable_ipv6) {
     netif_create_ip6_linklocal_address(default_, 1);
     printf("Starting lwIP, ip6 linklocal address is %s\n",
            ip6addr_ntoa(netif_ip6_addr(default_, 0)));
+    netif_default_add_ip6(handler);
   }
   netif_set_status_callback(default_, netif_default_status_callback);
   netif_set_link_callback(default_, netif_default_link_callback);
@@ -120,12 +301,72 @@ void netif_default_init(struct netif_handler *handler) {
   netif_set_up(default_);
 }
 
+void netif_default_update(struct netif_handler *handler) {
+  /* read/write and user data of a re-opened tun */
+  default_->state = handler;
+  if (!ip4_addr_cmp(&handler->ipaddr, netif_ip4_addr(default_)) ||
+      !ip4_addr_cmp(&handler->netmask, netif_ip4_netmask(default_)) ||
+      !ip4_addr_cmp(&handler->gw, netif_ip4_gw(default_))) {
+    LOG_DEBUG("Updating lwIP, local interface IP is %s\n", ip4addr_ntoa(&handler->ipaddr));
+    /* lwIP only drops pcbs bound to the old interface address */
+    netif_set_addr(default_, &handler->ipaddr, &handler->netmask, &handler->gw);
+  }
+  default_->mtu = handler->mtu ? handler->mtu : 1500;
+#if LWIP_IPV6 && LWIP_ND6_ALLOW_RA_UPDATES
+  default_->mtu6 = default_->mtu;
+#endif
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+  NETIF_SET_CHECKSUM_CTRL(default_, netif_default_chksum_flags(handler));
+#endif
+  if (handler->enable_ipv6) {
+    if (!ip6_addr_isvalid(netif_ip6_addr_state(default_, 0))) {
+      netif_create_ip6_linklocal_address(default_, 1);
+    }
+    netif_default_remove_ip6(handler);
+    netif_default_add_ip6(handler);
+  } else if (ip6_addr_isvalid(netif_ip6_addr_state(default_, 0))) {
+    /* go by the netif, handler may be the installed one edited in place */
+    netif_default_remove_ip6(NULL);
+    netif_ip6_addr_set_state(default_, 0, IP6_ADDR_INVALID);
+  }
+  if (handler->enable_sched && sched_ == NULL) {
+    sched_ = malloc(sizeof(struct netif_sched));
+    netif_sched_init(sched_);
+  } else if (!handler->enable_sched && sched_ != NULL) {
+    /* write out what is queued before going back to direct output */
+    struct netif_sched *sched = sched_;
+    netif_default_drain(default_, 0);
+    sched_ = 0;
+    netif_sched_clear(sched);
+    free(sched);
+  }
+}
+
 void netif_default_poll() {
   /* handle timers (already done in tcpip.c when NO_SYS=0) */
   sys_check_timeouts();
-  netif_default_input(default_);
+  /* timers and sends since the last pass go out before a read that may block */
+  netif_default_flush();
+  struct netif_handler *handler = (struct netif_handler *)default_->state;
+  int i, n = handler->read_max > 0 ? handler->read_max : 1;
+  for (i = 0; i < n; i++) {
+    /* the tun is drained or reads are throttled */
+    if (!netif_default_input(default_)) {
+      break;
+    }
+  }
   /* check for loopback packets on all netifs */
   netif_poll_all();
+  netif_default_flush();
+}
+
+u32_t netif_default_flush() {
+  if (sched_ == NULL) {
+    return 0;
+  }
+  struct netif_handler *handler = (struct netif_handler *)default_->state;
+  netif_default_drain(default_, handler->sched_rate);
+  return sched_->queued;
 }
 
 void netif_default_free() {
@@ -133,6 +374,19 @@ void netif_default_free() {
   netif_remove(default_);
   free(default_);
   default_ = 0;
+  if (sched_ != NULL) {
+    netif_sched_clear(sched_);
+    free(sched_);
+    sched_ = 0;
+  }
+}
+
+void netif_default_class_stats(int cls, struct netif_class_stats *stats) {
+  if (sched_ == NULL || cls < 0 || cls >= NETIF_CLASS_MAX) {
+    memset(stats, 0, sizeof(struct netif_class_stats));
+    return;
+  }
+  *stats = sched_->classes[cls].stats;
 }
 
 void lwip_platform_assert(const char *msg, int line, const char *file) {
@@ -0,0 +1,218 @@
+
+#include "netif_sched.h"
+#include "memgov.h"
+#include "lwip/sys.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NETIF_SCHED_PROTO_TCP 6
+#define NETIF_SCHED_PROTO_UDP 17
+
+/* dscp values the classes are marked with and recognised by */
+#define NETIF_DSCP_EF 46
+#define NETIF_DSCP_CS1 8
+#define NETIF_DSCP_LE 1
+
+u8_t netif_class_tos(int cls) {
+  switch (cls) {
+  case NETIF_CLASS_INTERACTIVE:
+    return NETIF_DSCP_EF << 2;
+  case NETIF_CLASS_BULK:
+    return NETIF_DSCP_CS1 << 2;
+  default:
+    return 0;
+  }
+}
+
+static int netif_sched_classify(u8_t tos) {
+  u8_t dscp = tos >> 2;
+  if (dscp == NETIF_DSCP_EF || dscp >= 40 || (dscp >= 34 && dscp <= 38)) {
+    /* ef, cs5-cs7 and af4x */
+    return NETIF_CLASS_INTERACTIVE;
+  }
+  if (dscp == NETIF_DSCP_CS1 || dscp == NETIF_DSCP_LE) {
+    return NETIF_CLASS_BULK;
+  }
+  return NETIF_CLASS_NORMAL;
+}
+
+/* classify an outgoing ip packet and hash its 5-tuple, headers are in the first pbuf */
+static u32_t netif_sched_flow_hash(struct pbuf *p, int *cls) {
+  const u8_t *h = p->payload;
+  u32_t hash = 2166136261u;
+  u16_t off, addr_off, addr_len, i;
+  u8_t proto;
+  *cls = NETIF_CLASS_NORMAL;
+  if (p->len < 20) {
+    return 0;
+  }
+  if ((h[0] >> 4) == 4) {
+    *cls = netif_sched_classify(h[1]);
+    proto = h[9];
+    addr_off = 12;
+    addr_len = 8;
+    off = (u16_t)((h[0] & 0x0f) * 4);
+  } else if ((h[0] >> 4) == 6 && p->len >= 40) {
+    *cls = netif_sched_classify((u8_t)((h[0] << 4) | (h[1] >> 4)));
+    proto = h[6];
+    addr_off = 8;
+    addr_len = 32;
+    off = 40;
+  } else {
+    return 0;
+  }
+  for (i = addr_off; i < addr_off + addr_len; i++) {
+    hash = (hash ^ h[i]) * 16777619u;
+  }
+  hash = (hash ^ proto) * 16777619u;
+  if ((proto == NETIF_SCHED_PROTO_TCP || proto == NETIF_SCHED_PROTO_UDP) && p->len >= off + 4) {
+    for (i = off; i < off + 4; i++) {
+      hash = (hash ^ h[i]) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+void netif_sched_init(struct netif_sched *sched) {
+  memset(sched, 0, sizeof(struct netif_sched));
+  sched->last = sys_now();
+}
+
+void netif_sched_clear(struct netif_sched *sched) {
+  struct netif_sched_pkt *pkt;
+  int c, f;
+  for (c = 0; c < NETIF_CLASS_MAX; c++) {
+    for (f = 0; f < NETIF_SCHED_FLOWS; f++) {
+      struct netif_sched_flow *flow = &sched->classes[c].flows[f];
+      while ((pkt = flow->head) != NULL) {
+        flow->head = pkt->next;
+        memgov_uncharge(MEMGOV_SCHED, pkt->p->tot_len);
+        pbuf_free(pkt->p);
+        free(pkt);
+      }
+    }
+  }
+  while ((pkt = sched->free_pkts) != NULL) {
+    sched->free_pkts = pkt->next;
+    free(pkt);
+  }
+  netif_sched_init(sched);
+}
+
+err_t netif_sched_enqueue(struct netif_sched *sched, struct pbuf *p) {
+  int c;
+  u32_t hash = netif_sched_flow_hash(p, &c);
+  struct netif_sched_class *cls = &sched->classes[c];
+  struct netif_sched_flow *flow = &cls->flows[(hash >> 16) % NETIF_SCHED_FLOWS];
+  struct netif_sched_pkt *pkt = sched->free_pkts;
+  if (sched->queued >= NETIF_SCHED_LIMIT) {
+    cls->stats.drops++;
+    return ERR_MEM;
+  }
+  if (pkt != NULL) {
+    sched->free_pkts = pkt->next;
+  } else if ((pkt = malloc(sizeof(struct netif_sched_pkt))) == NULL) {
+    cls->stats.drops++;
+    return ERR_MEM;
+  }
+  /* lwIP keeps the pbuf for retransmission, hold our own reference */
+  pbuf_ref(p);
+  memgov_charge(MEMGOV_SCHED, p->tot_len);
+  pkt->p = p;
+  pkt->next = NULL;
+  pkt->enqueued = sys_now();
+  if (flow->tail != NULL) {
+    flow->tail->next = pkt;
+  } else {
+    flow->head = pkt;
+  }
+  flow->tail = pkt;
+  if (!flow->active) {
+    flow->active = 1;
+    flow->deficit = 0;
+    flow->next = NULL;
+    if (cls->active_tail != NULL) {
+      cls->active_tail->next = flow;
+    } else {
+      cls->active_head = flow;
+    }
+    cls->active_tail = flow;
+  }
+  sched->queued++;
+  cls->stats.queued++;
+  return ERR_OK;
+}
+
+static struct netif_sched_pkt *netif_sched_class_dequeue(struct netif_sched_class *cls) {
+  struct netif_sched_flow *flow;
+  while ((flow = cls->active_head) != NULL) {
+    struct netif_sched_pkt *pkt = flow->head;
+    if (flow->deficit < pkt->p->tot_len) {
+      /* out of credit, top up and go to the back of the round */
+      flow->deficit += NETIF_SCHED_QUANTUM;
+      if (flow->next != NULL) {
+        cls->active_head = flow->next;
+        flow->next = NULL;
+        cls->active_tail->next = flow;
+        cls->active_tail = flow;
+      }
+      continue;
+    }
+    flow->deficit -= pkt->p->tot_len;
+    flow->head = pkt->next;
+    if (flow->head == NULL) {
+      flow->tail = NULL;
+      flow->active = 0;
+      cls->active_head = flow->next;
+      if (cls->active_head == NULL) {
+        cls->active_tail = NULL;
+      }
+      flow->next = NULL;
+    }
+    return pkt;
+  }
+  return NULL;
+}
+
+struct pbuf *netif_sched_dequeue(struct netif_sched *sched, u32_t rate) {
+  u32_t now = sys_now();
+  int c;
+  if (sched->queued == 0) {
+    return NULL;
+  }
+  if (rate > 0) {
+    /* token bucket in bytes holding at most 10ms or two full packets */
+    s32_t burst = (s32_t)LWIP_MAX(rate / 100, 2 * NETIF_SCHED_QUANTUM);
+    u32_t elapsed = now - sched->last;
+    sched->last = now;
+    u32_t refill = rate / 1000 * elapsed + rate % 1000 * elapsed / 1000;
+    if (elapsed >= 1000 || sched->tokens + (s32_t)refill > burst) {
+      sched->tokens = burst;
+    } else {
+      sched->tokens += (s32_t)refill;
+    }
+    if (sched->tokens <= 0) {
+      return NULL;
+    }
+  }
+  for (c = 0; c < NETIF_CLASS_MAX; c++) {
+    struct netif_sched_class *cls = &sched->classes[c];
+    struct netif_sched_pkt *pkt = netif_sched_class_dequeue(cls);
+    if (pkt == NULL) {
+      continue;
+    }
+    struct pbuf *p = pkt->p;
+    u32_t delay = now - pkt->enqueued;
+    sched->queued--;
+    cls->stats.queued--;
+    cls->stats.packets++;
+    cls->stats.delay_sum += delay;
+    cls->stats.delay_max = LWIP_MAX(cls->stats.delay_max, delay);
+    sched->tokens -= p->tot_len;
+    memgov_uncharge(MEMGOV_SCHED, p->tot_len);
+    pkt->next = sched->free_pkts;
+    sched->free_pkts = pkt;
+    return p;
+  }
+  return NULL;
+}
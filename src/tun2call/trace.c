@@ -0,0 +1,55 @@
+
+#include "trace.h"
+#include <stdio.h>
+#include <time.h>
+
+#if TUN2CALL_TRACE
+int trace_enabled_ = 0;
+static FILE *trace_file_ = NULL;
+
+int trace_open(const char *path) {
+  struct trace_header hdr = {TRACE_MAGIC, TRACE_VERSION};
+  trace_close();
+  trace_file_ = fopen(path, "wb");
+  if (trace_file_ == NULL) {
+    return -1;
+  }
+  if (fwrite(&hdr, sizeof(hdr), 1, trace_file_) != 1) {
+    fclose(trace_file_);
+    trace_file_ = NULL;
+    return -1;
+  }
+  trace_enabled_ = 1;
+  return 0;
+}
+
+void trace_close(void) {
+  trace_enabled_ = 0;
+  if (trace_file_ != NULL) {
+    fclose(trace_file_);
+    trace_file_ = NULL;
+  }
+}
+
+void trace_emit(uint16_t event, uint32_t flow, uint32_t arg) {
+  struct trace_record r;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  r.ns = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+  r.flow = flow;
+  r.arg = arg;
+  r.event = event;
+  r.reserved = 0;
+  r.pad = 0;
+  /* stdio buffers, a short write only loses the tail of the trace */
+  fwrite(&r, sizeof(r), 1, trace_file_);
+}
+#else
+int trace_open(const char *path) {
+  (void)path;
+  return -1;
+}
+
+void trace_close(void) {
+}
+#endif